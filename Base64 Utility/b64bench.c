@@ -0,0 +1,597 @@
+/* Microbenchmark and self-check for libb64: checks every kernel against the scalar kernel and the
+   original per-group encoder, reports encode/decode throughput per kernel and output variant, then sweeps
+   buffer sizes from 1 KiB up to MAX_MiB reporting MB/s, cycles/byte and peak RSS for each backend
+   (scalar, SIMD, threaded, mmap).
+
+   Usage: b64bench [MAX_MiB]    (default 1024)
+*/
+
+#include <stdio.h>      // Standard input and output
+#include <stdlib.h>     // malloc(), free(), rand()
+#include <stdint.h>     // Extra fixed-width data types
+#include <string.h>     // memcmp(), memcpy(), memset()
+#include <err.h>        // Convenience functions for error reporting (non-standard)
+#include <errno.h>      // EINTR
+#include <stdbool.h>    // Boolean type and values
+#include <time.h>       // clock_gettime()
+#include <unistd.h>     // fork(), pipe(), sysconf()
+#include <sys/mman.h>   // mmap() for the mmap backend
+#include <sys/resource.h> // getrusage() peak RSS
+#include <sys/wait.h>   // waitpid()
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>  // __rdtsc()
+#define B64_X86 1
+#endif
+
+#include "libb64.h"
+
+#define BENCH_BLOCK_SIZE  65536                             /* Streaming runs feed the encoder and decoder 64 KiB at a time */
+#define BENCH_KERNEL_MIB  64                                /* Input size for the per-kernel, per-variant table */
+#define BENCH_MAP_SIZE    (1 << 20)                         /* mmap backend: 1 MiB of mapped input per encoder update, as in base64 */
+#define BENCH_SWEEP_BYTES (64 << 20)                        /* Sweep: repeat small sizes until this much data has gone through */
+
+static char const b64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                   "abcdefghijklmnopqrstuvwxyz"
+                                   "0123456789"
+                                   "+/";
+
+// Output variants covered by the benchmark; the first is the default MIME format
+static struct bench_variant {
+    char const *name;
+    struct b64_options opts;
+} const bench_variants[] = {
+    {"mime",    {.url = false, .pad = true,  .line_chars = B64_LINE_CHARS, .final_newline = true}},
+    {"url-raw", {.url = true,  .pad = false, .line_chars = 0,              .final_newline = false}},
+    {"w70",     {.url = false, .pad = true,  .line_chars = 70,             .final_newline = true}},
+};
+#define N_BENCH_VARIANTS (sizeof(bench_variants) / sizeof(bench_variants[0]))
+
+/* Original per-group encoder of the base64 utility, as it was: one 3-byte group at a time through stdio,
+   fread() of 3 bytes and fwrite() of 4 characters per group, MIME output only. Kept as the reference the
+   library output must match, and as the baseline that shows what those per-group calls cost.
+*/
+static void encode_per_group(FILE *input, FILE *stream) {
+    size_t char_count = 0;                                  /* For wrapping encoded lines every 76 characters */
+    size_t total_bytes_read = 0;
+    bool need_newline = false;
+
+    for (;;) {
+        uint8_t input_bytes[3] = {0};                       /* 3 bytes or 24 bits is least common multiple of 8-bit ASCII input character and 6-bit Base64 output character */
+        size_t n_read = fread(input_bytes, 1, 3, input);    /* # of bytes read = n_read = fread(destination for read data, read byte-by-byte, read 3 bytes, data to read) */
+        total_bytes_read += n_read;
+
+        if (n_read != 0) {
+            // Convert 3 bytes (24 bits) of ASCII input data into 4 characters of Base64 output
+            int alph_ind[4];
+            alph_ind[0] = input_bytes[0] >> 2;                                  /* Right shift two bits/discard last two bits. Ex: ABCDEFGH -> 00ABCEDF */
+            alph_ind[1] = (input_bytes[0] << 4 | input_bytes[1] >> 4) & 0x3Fu;  /* Last two bits of first byte + first 4 bits of second byte */
+            alph_ind[2] = (input_bytes[1] << 2 | input_bytes[2] >> 6) & 0x3Fu;  /* Last four bits of second byte + first 2 bits of third byte */
+            alph_ind[3] = input_bytes[2] & 0x3Fu;                               /* Last six bits of third byte */
+
+            char output[5];                                                     /* 4 Base64 characters + null terminator */
+            int output_length = 0;
+            for (size_t i = 0; i < 4; i++) {
+                output[i] = (i <= n_read) ? b64_alphabet[alph_ind[i]] : '=';
+                output_length++;
+            }
+            output[4] = '\0';                                                   /* Null-terminate the string */
+
+            // Write to the output stream
+            size_t n_write = fwrite(output, 1, output_length, stream);          /* # of bytes written = n_write = fwrite(array of Base64-encoded char, write 1 char/byte, write all all output, output stream) */
+            char_count += n_write;
+
+            if (char_count >= 76) {                                             /* Wrap output to 76 characters */
+                putc('\n', stream);
+                char_count = 0;
+                need_newline = false;                                           // Set to false when we manually print a newline.
+            } else if (char_count > 0) {
+                need_newline = true;                                            // If any characters were printed since the last newline, set to true.
+            }
+
+            if (ferror(stream)) {
+                err(1, "Write error");                                          /* Write error */
+            }
+        }
+
+        // If less than three bytes were read:
+        if (n_read < 3) {
+            if (feof(input)) {                                  /* End of file */
+                if (need_newline && total_bytes_read > 0) {
+                    putc('\n', stream);
+                }
+                break;
+            }
+            if (ferror(input)) {
+                err(1, "Read error");                           /* Read error */
+            }
+        }
+    }
+    fflush(stream);
+}
+
+static double elapsed_seconds(struct timespec const *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Encode through the streaming interface, splitting the input at random points, so that every carry
+   (0, 1 or 2 pending bytes) and every column is seen at an update() boundary
+*/
+static size_t encode_split(struct b64_options const *opts, uint8_t const *in, size_t len, char *out) {
+    struct b64_encoder enc;
+    size_t n_out = 0;
+    b64_encoder_init(&enc, opts);
+    for (size_t off = 0; off < len; ) {
+        size_t n = rand() % 8;
+        if (n > len - off) {
+            n = len - off;
+        }
+        n_out += b64_encoder_update(&enc, in + off, n, out + n_out);
+        off += n;
+    }
+    return n_out + b64_encoder_final(&enc, out + n_out);
+}
+
+/* Compare every supported kernel with the scalar kernel, in every variant, for every input length up to
+   64 groups plus 0, 1 or 2 tail bytes, so every SIMD loop count, scalar remainder, line break and padding
+   case is exercised: one-shot and split streaming encodes must match the scalar encoder, the decoder must
+   round-trip the input, and after a random single-character corruption the decoder must fail (or succeed)
+   exactly like the scalar decoder.
+*/
+static void check_kernels(void) {
+    enum { MAX_LEN = 64 * 3 + 2, MAX_CHARS = 1024, CORRUPTIONS = 64 };
+    uint8_t in[MAX_LEN];
+    char expected[MAX_CHARS], actual[MAX_CHARS], split[MAX_CHARS];
+    uint8_t decoded[MAX_CHARS + B64_DECODE_SLACK], reference[MAX_CHARS + B64_DECODE_SLACK];
+
+    for (size_t i = 0; i < MAX_LEN; i++) {
+        in[i] = rand() & 0xFF;
+    }
+
+    for (size_t v = 0; v < N_BENCH_VARIANTS; v++) {
+        struct b64_options const *opts = &bench_variants[v].opts;
+        for (char const *const *k = b64_kernel_names; *k; k++) {
+            if (!b64_use_kernel(*k)) continue;
+            for (size_t len = 0; len <= MAX_LEN; len++) {
+                b64_use_kernel("scalar");
+                size_t n_expected = b64_encode_buf(opts, in, len, expected);
+                b64_use_kernel(*k);
+                size_t n_actual = b64_encode_buf(opts, in, len, actual);
+                size_t n_split = encode_split(opts, in, len, split);
+                if (n_actual != n_expected || memcmp(actual, expected, n_expected)
+                        || n_actual != b64_encoded_size(opts, len)) {
+                    errx(1, "%s kernel output differs from scalar for %zu input bytes (%s)", *k, len, bench_variants[v].name);
+                }
+                if (n_split != n_expected || memcmp(split, expected, n_expected)) {
+                    errx(1, "%s streaming output differs from one-shot for %zu input bytes (%s)", *k, len, bench_variants[v].name);
+                }
+
+                struct b64_decoder dec, ref;
+                size_t n_decoded, n_reference;
+                if (!b64_decode_buf(&dec, opts, actual, n_actual, decoded, &n_decoded) || n_decoded != len || memcmp(decoded, in, len)) {
+                    errx(1, "%s kernel does not round-trip %zu input bytes (%s)", *k, len, bench_variants[v].name);
+                }
+
+                for (int c = 0; c < CORRUPTIONS && n_actual > 0; c++) {
+                    memcpy(actual, expected, n_expected);
+                    actual[rand() % n_actual] = rand() & 0xFF;
+                    b64_use_kernel("scalar");
+                    bool ref_ok = b64_decode_buf(&ref, opts, actual, n_actual, reference, &n_reference);
+                    b64_use_kernel(*k);
+                    bool ok = b64_decode_buf(&dec, opts, actual, n_actual, decoded, &n_decoded);
+                    if (ok != ref_ok || (ok && (n_decoded != n_reference || memcmp(decoded, reference, n_decoded)))
+                            || (!ok && (dec.error != ref.error || dec.error_offset != ref.error_offset))) {
+                        errx(1, "%s decoder disagrees with scalar on corrupted input of %zu characters (%s)",
+                             *k, n_actual, bench_variants[v].name);
+                    }
+                }
+            }
+        }
+    }
+    b64_use_kernel(b64_kernel_names[0]);
+}
+
+/* In-memory encode (one-shot and 64 KiB updates) and decode throughput of each supported kernel over buf,
+   in each variant
+*/
+static void bench_kernels(uint8_t const *buf, size_t size) {
+    uint8_t *decoded = malloc(b64_decode_bound(b64_encoded_size(&bench_variants[0].opts, size)));
+    if (!decoded) {
+        err(1, "Memory allocation failed");
+    }
+    memset(decoded, 0xFF, size);                            /* Fault the pages in so the first kernel is not penalized */
+
+    for (size_t v = 0; v < N_BENCH_VARIANTS; v++) {
+        struct b64_options const *opts = &bench_variants[v].opts;
+        size_t n_encoded = b64_encoded_size(opts, size);
+        char *encoded = malloc(n_encoded + B64_FINAL_MAX + b64_encode_bound(opts, BENCH_BLOCK_SIZE));
+        if (!encoded) {
+            err(1, "Memory allocation failed");
+        }
+        memset(encoded, 0xFF, n_encoded);                   /* Non-zero, or malloc+memset turns into calloc and faults nothing */
+
+        for (char const *const *k = b64_kernel_names; *k; k++) {
+            if (!b64_use_kernel(*k)) {
+                printf("kernel %-7s %-8s not supported by this CPU\n", *k, bench_variants[v].name);
+                continue;
+            }
+
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            size_t n_out = b64_encode_buf(opts, buf, size, encoded);
+            double t_encode = elapsed_seconds(&start);
+
+            struct b64_encoder enc;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            b64_encoder_init(&enc, opts);
+            size_t n_stream = 0;
+            for (size_t off = 0; off < size; off += BENCH_BLOCK_SIZE) {
+                size_t len = size - off < BENCH_BLOCK_SIZE ? size - off : BENCH_BLOCK_SIZE;
+                n_stream += b64_encoder_update(&enc, buf + off, len, encoded + n_stream);
+            }
+            n_stream += b64_encoder_final(&enc, encoded + n_stream);
+            double t_stream = elapsed_seconds(&start);
+            if (n_stream != n_out || n_out != n_encoded) {
+                errx(1, "%s kernel: encoded sizes disagree (%s)", *k, bench_variants[v].name);
+            }
+
+            struct b64_decoder dec;
+            size_t n_decoded = 0, n_block;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            b64_decoder_init(&dec, opts);
+            for (size_t off = 0; off < n_out; off += BENCH_BLOCK_SIZE) {
+                size_t len = n_out - off < BENCH_BLOCK_SIZE ? n_out - off : BENCH_BLOCK_SIZE;
+                if (!b64_decoder_update(&dec, encoded + off, len, decoded + n_decoded, &n_block)) {
+                    errx(1, "%s decoder: %s at offset %llu", *k, dec.error, (unsigned long long)dec.error_offset);
+                }
+                n_decoded += n_block;
+            }
+            if (!b64_decoder_final(&dec, decoded + n_decoded, &n_block)) {
+                errx(1, "%s decoder: %s at offset %llu", *k, dec.error, (unsigned long long)dec.error_offset);
+            }
+            n_decoded += n_block;
+            double t_decode = elapsed_seconds(&start);
+            if (n_decoded != size || memcmp(decoded, buf, size)) {
+                errx(1, "%s kernel does not round-trip the benchmark input (%s)", *k, bench_variants[v].name);
+            }
+
+            printf("kernel %-7s %-8s encode %8.1f MB/s  stream %8.1f MB/s  decode %8.1f MB/s\n", *k,
+                   bench_variants[v].name, size / 1e6 / t_encode, size / 1e6 / t_stream, size / 1e6 / t_decode);
+        }
+        free(encoded);
+    }
+
+    b64_use_kernel(b64_kernel_names[0]);
+    free(decoded);
+}
+
+/* Fast pseudo-random fill (xorshift64*): rand() per byte would dominate setup at 1 GiB
+*/
+static void fill_random(uint8_t *buf, size_t len, uint64_t *state) {
+    for (size_t i = 0; i < len; i += 8) {
+        *state ^= *state >> 12;
+        *state ^= *state << 25;
+        *state ^= *state >> 27;
+        uint64_t r = *state * 0x2545F4914F6CDD1DULL;
+        memcpy(buf + i, &r, len - i < 8 ? len - i : 8);
+    }
+}
+
+/* Time stamp counter for cycles/byte. It ticks at the nominal clock rate, not the current core clock,
+   so it is comparable between runs on one machine rather than an exact core cycle count.
+*/
+static uint64_t read_cycles(void) {
+#ifdef B64_X86
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void write_all(int fd, void const *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            err(1, "Write error");
+        }
+        buf = (char const *)buf + n;
+        len -= n;
+    }
+}
+
+// Backends measured by the sweep
+enum backend { SCALAR, SIMD, THREADED, MAPPED, N_BACKENDS };
+static char const *const backend_names[] = {"scalar", "simd", "threaded", "mmap"};
+
+struct sweep_result {
+    double encode_seconds, decode_seconds;                  /* Per pass */
+    uint64_t encode_cycles, decode_cycles;                  /* Per pass */
+    long peak_rss_kib;
+    int threads;
+    bool has_decode;                                        /* The threaded backend has no decoder of its own */
+};
+
+/* Encode and decode size bytes of random data reps times with one backend and record per-pass times.
+   Runs in a child process of its own, so peak RSS covers this backend and size only.
+*/
+static void sweep_backend(enum backend backend, size_t size, int reps, struct sweep_result *r) {
+    struct b64_options const *mime = &bench_variants[0].opts;
+    size_t n_encoded = b64_encoded_size(mime, size);
+    uint64_t state = 0x9E3779B97F4A7C15ULL ^ size;
+    struct timespec start;
+    uint64_t cycles;
+
+    r->threads = 1;
+    r->has_decode = true;
+    b64_use_kernel(backend == SCALAR ? "scalar" : b64_kernel_names[0]);
+
+    if (backend != MAPPED) {
+        uint8_t *in = malloc(size);
+        char *encoded = malloc(n_encoded);
+        uint8_t *decoded = malloc(b64_decode_bound(n_encoded));
+        if (!in || !encoded || !decoded) {
+            err(1, "Memory allocation failed");
+        }
+        fill_random(in, size, &state);
+        memset(encoded, 0xFF, n_encoded);                   /* Fault the pages in outside the timed loop */
+        memset(decoded, 0xFF, size);
+
+        if (backend == THREADED) {
+            long n = sysconf(_SC_NPROCESSORS_ONLN);
+            r->threads = n > 0 ? n : 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        cycles = read_cycles();
+        for (int i = 0; i < reps; i++) {
+            if (backend == THREADED) {
+                b64_encode_buf_parallel(mime, in, size, encoded, r->threads);
+            } else {
+                b64_encode_buf(mime, in, size, encoded);
+            }
+        }
+        r->encode_cycles = (read_cycles() - cycles) / reps;
+        r->encode_seconds = elapsed_seconds(&start) / reps;
+
+        struct b64_decoder dec;
+        size_t n_decoded = 0;
+        r->has_decode = backend != THREADED;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        cycles = read_cycles();
+        for (int i = 0; i < reps; i++) {
+            if (!b64_decode_buf(&dec, mime, encoded, n_encoded, decoded, &n_decoded)) {
+                errx(1, "%s decoder: %s at offset %llu", backend_names[backend], dec.error, (unsigned long long)dec.error_offset);
+            }
+        }
+        r->decode_cycles = (read_cycles() - cycles) / reps;
+        r->decode_seconds = elapsed_seconds(&start) / reps;
+        if (n_decoded != size || memcmp(decoded, in, size)) {
+            errx(1, "%s backend does not round-trip %zu bytes", backend_names[backend], size);
+        }
+
+        free(in);
+        free(encoded);
+        free(decoded);
+    } else {
+        // Input and encoded data live in files and are mapped for every pass, the way the base64 utility
+        // encodes regular files: 1 MiB of mapped input at a time into one reused buffer
+        size_t chunk = BENCH_MAP_SIZE < size ? BENCH_MAP_SIZE : size;
+        char *out = malloc(b64_encode_bound(mime, chunk) + B64_FINAL_MAX);
+        uint8_t *decoded = malloc(chunk + B64_DECODE_SLACK);       /* Also stages the input while the files are written */
+        FILE *in_file = tmpfile(), *encoded_file = tmpfile();
+        if (!out || !decoded || !in_file || !encoded_file) {
+            err(1, "Failed to set up the mmap benchmark");
+        }
+        int in_fd = fileno(in_file), encoded_fd = fileno(encoded_file);
+
+        struct b64_encoder enc;
+        b64_encoder_init(&enc, mime);
+        for (size_t off = 0; off < size; off += chunk) {
+            size_t len = size - off < chunk ? size - off : chunk;
+            fill_random(decoded, len, &state);
+            write_all(in_fd, decoded, len);
+            size_t n_out = b64_encoder_update(&enc, decoded, len, out);
+            if (off + len == size) {
+                n_out += b64_encoder_final(&enc, out + n_out);
+            }
+            write_all(encoded_fd, out, n_out);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        cycles = read_cycles();
+        for (int i = 0; i < reps; i++) {
+            uint8_t *in = mmap(NULL, size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+            if (in == MAP_FAILED) {
+                err(1, "Failed to map input");
+            }
+            madvise(in, size, MADV_SEQUENTIAL);
+            b64_encoder_init(&enc, mime);
+            for (size_t off = 0; off < size; off += chunk) {
+                size_t len = size - off < chunk ? size - off : chunk;
+                b64_encoder_update(&enc, in + off, len, out);
+            }
+            b64_encoder_final(&enc, out);
+            munmap(in, size);
+        }
+        r->encode_cycles = (read_cycles() - cycles) / reps;
+        r->encode_seconds = elapsed_seconds(&start) / reps;
+
+        uint8_t *in = mmap(NULL, size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+        if (in == MAP_FAILED) {
+            err(1, "Failed to map input");
+        }
+        struct b64_decoder dec;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        cycles = read_cycles();
+        for (int i = 0; i < reps; i++) {
+            char *encoded = mmap(NULL, n_encoded, PROT_READ, MAP_PRIVATE, encoded_fd, 0);
+            if (encoded == MAP_FAILED) {
+                err(1, "Failed to map encoded data");
+            }
+            madvise(encoded, n_encoded, MADV_SEQUENTIAL);
+            b64_decoder_init(&dec, mime);
+            size_t n_decoded = 0, n_block;
+            for (size_t off = 0; off < n_encoded; off += chunk) {
+                size_t len = n_encoded - off < chunk ? n_encoded - off : chunk;
+                if (!b64_decoder_update(&dec, encoded + off, len, decoded, &n_block)) {
+                    errx(1, "mmap decoder: %s at offset %llu", dec.error, (unsigned long long)dec.error_offset);
+                }
+                // Checked on the last pass only, outside the timing of the others
+                if (i == reps - 1 && memcmp(decoded, in + n_decoded, n_block)) {
+                    errx(1, "mmap backend does not round-trip %zu bytes", size);
+                }
+                n_decoded += n_block;
+            }
+            munmap(encoded, n_encoded);
+        }
+        r->decode_cycles = (read_cycles() - cycles) / reps;
+        r->decode_seconds = elapsed_seconds(&start) / reps;
+
+        munmap(in, size);
+        fclose(in_file);
+        fclose(encoded_file);
+        free(out);
+        free(decoded);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    r->peak_rss_kib = usage.ru_maxrss;
+}
+
+/* Run sweep_backend() in a child process and collect its result through a pipe
+*/
+static void sweep_measure(enum backend backend, size_t size, int reps, struct sweep_result *r) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        err(1, "Failed to create pipe");
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        err(1, "Failed to fork");
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        sweep_backend(backend, size, reps, r);
+        write_all(fds[1], r, sizeof(*r));
+        _exit(0);
+    }
+
+    close(fds[1]);
+    ssize_t n = read(fds[0], r, sizeof(*r));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (n != sizeof(*r) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        errx(1, "%s backend failed at %zu bytes", backend_names[backend], size);
+    }
+}
+
+/* Size sweep: 1 KiB to max_size in steps of 4x, every backend, MIME output. Small sizes are repeated until
+   about BENCH_SWEEP_BYTES have gone through, so every line is a stable per-pass average.
+*/
+static void run_sweep(size_t max_size) {
+    printf("\n%-9s %-9s %3s %12s %7s %12s %7s %13s\n", "size", "backend", "thr", "encode MB/s", "cyc/B",
+           "decode MB/s", "cyc/B", "peak RSS");
+    for (size_t size = 1024; size <= max_size; size *= 4) {
+        int reps = size < BENCH_SWEEP_BYTES ? BENCH_SWEEP_BYTES / size : 1;
+        char size_name[16];
+        if (size >= 1 << 30) {
+            snprintf(size_name, sizeof(size_name), "%zu GiB", size >> 30);
+        } else if (size >= 1 << 20) {
+            snprintf(size_name, sizeof(size_name), "%zu MiB", size >> 20);
+        } else {
+            snprintf(size_name, sizeof(size_name), "%zu KiB", size >> 10);
+        }
+
+        for (int b = 0; b < N_BACKENDS; b++) {
+            struct sweep_result r = {0};
+            sweep_measure(b, size, reps, &r);
+            printf("%-9s %-9s %3d %12.1f %7.3f", size_name, backend_names[b], r.threads,
+                   size / 1e6 / r.encode_seconds, (double)r.encode_cycles / size);
+            if (r.has_decode) {
+                printf(" %12.1f %7.3f", size / 1e6 / r.decode_seconds, (double)r.decode_cycles / size);
+            } else {
+                printf(" %12s %7s", "-", "-");
+            }
+            printf(" %9ld KiB\n", r.peak_rss_kib);
+        }
+    }
+}
+
+/* Check the kernels, check the library against the per-group reference, report MB/s for the reference
+   and for each kernel and output variant, then run the size sweep up to max_mib MiB.
+*/
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        errx(1, "Usage: %s [MAX_MiB]", argv[0]);
+    }
+    size_t max_mib = argc == 2 ? strtoul(argv[1], NULL, 10) : 1024;
+    if (max_mib == 0) {
+        errx(1, "Invalid size: %s", argv[1]);
+    }
+
+    // Random input; the odd extra byte exercises the '=' padding path
+    size_t size = (max_mib < BENCH_KERNEL_MIB ? max_mib : BENCH_KERNEL_MIB) * 1024 * 1024 + 1;
+    struct b64_options const *mime = &bench_variants[0].opts;
+    size_t n_encoded = b64_encoded_size(mime, size);
+    uint8_t *buf = malloc(size);
+    char *reference = malloc(n_encoded);
+    char *encoded = malloc(n_encoded);
+    if (!buf || !reference || !encoded) {
+        err(1, "Memory allocation failed");
+    }
+    srand(time(0));
+    for (size_t i = 0; i < size; i++) {
+        buf[i] = rand() & 0xFF;
+    }
+    memset(reference, 0xFF, n_encoded);
+    memset(encoded, 0xFF, n_encoded);
+
+    check_kernels();
+
+    // Byte-identical output check, then timed runs
+    // The reference reads the input through a memory stream and writes to a temporary file, as the
+    // original --bench did, so that its time is the per-group stdio calls and not the disk
+    FILE *per_group_in = fmemopen(buf, size, "rb"), *per_group_out = tmpfile();
+    if (!per_group_in || !per_group_out) {
+        err(1, "Failed to set up the per-group reference");
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    encode_per_group(per_group_in, per_group_out);
+    if (fflush(per_group_out) == EOF) {
+        err(1, "Write error");
+    }
+    double t_per_group = elapsed_seconds(&start);
+    size_t n_reference = ftell(per_group_out);
+    rewind(per_group_out);
+    if (n_reference > n_encoded || fread(reference, 1, n_reference, per_group_out) != n_reference) {
+        errx(1, "Per-group encoder output has the wrong size");
+    }
+    fclose(per_group_in);
+    fclose(per_group_out);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t n_out = b64_encode_buf(mime, buf, size, encoded);
+    double t_lib = elapsed_seconds(&start);
+    if (n_out != n_reference || memcmp(encoded, reference, n_out)) {
+        errx(1, "Library output differs from per-group encoder output");
+    }
+
+    double mb = size / 1e6;
+    printf("input: %zu bytes, kernel %s\n", size, b64_kernel());
+    printf("per-group: %8.1f MB/s\n", mb / t_per_group);
+    printf("libb64:    %8.1f MB/s (%.1fx)\n", mb / t_lib, t_per_group / t_lib);
+    bench_kernels(buf, size);
+
+    free(buf);
+    free(reference);
+    free(encoded);
+
+    run_sweep(max_mib * 1024 * 1024);
+    return 0;
+}
@@ -0,0 +1,223 @@
+/* Regression check for how the base64 utility picks its input backend: each case runs ./base64 on an
+   input its fast paths once got wrong and compares the output with libb64's encoding of what a plain
+   read() loop sees from that descriptor.
+
+   - Files in /proc report a size of 0 but have contents, which must not encode to nothing, alone or as
+     part of a batch.
+   - A regular-file stdin that was partly read already is encoded from where its offset stands, not from
+     byte 0, for small files (single read()) and large ones (mmap()).
+   Each case runs both serially and with -j 4, which splits mapped files between threads.
+
+   Usage: b64check [BASE64]    (default ./base64). Exits with 1 if any check failed.
+*/
+
+#include <stdio.h>      // Standard input and output
+#include <stdlib.h>     // malloc(), free(), mkstemp()
+#include <string.h>     // memcmp(), strlen()
+#include <err.h>        // Convenience functions for error reporting (non-standard)
+#include <errno.h>      // EINTR
+#include <stdbool.h>    // Boolean type and values
+#include <stdint.h>     // Extra fixed-width data types
+#include <fcntl.h>      // open()
+#include <unistd.h>     // fork(), pipe(), dup2(), execv(), lseek()
+#include <sys/stat.h>   // stat()
+#include <sys/wait.h>   // waitpid()
+
+#include "libb64.h"     // The expected output
+#include "checksum.h"   // The expected --crc32c
+
+#define CHECK_LARGE_SIZE ((1 << 20) + 1000)                 /* Over B64_BLOCK_SIZE, so ./base64 maps it */
+#define CHECK_SMALL_SIZE 1000                               /* Under B64_BLOCK_SIZE, so ./base64 reads it at once */
+
+static char const *program = "./base64";
+static int failures = 0;
+
+/* Everything left to read on fd, in memory from malloc(); *size gets its length
+*/
+static uint8_t *read_rest(int fd, size_t *size) {
+    size_t cap = 65536, n = 0;
+    uint8_t *data = malloc(cap);
+    for (;;) {
+        if (!data) {
+            err(1, "Memory allocation failed");
+        }
+        ssize_t r = read(fd, data + n, cap - n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) {
+            err(1, "Read error");
+        }
+        if (r == 0) break;
+        n += r;
+        if (n == cap) {
+            data = realloc(data, cap *= 2);
+        }
+    }
+    *size = n;
+    return data;
+}
+
+/* Run program with args (NULL-terminated, after the program name) on standard input in_fd, and return its
+   output; *size gets its length
+*/
+static char *run(char *const args[], int in_fd, size_t *size) {
+    char *argv[16] = {(char *)program};
+    for (int i = 0; args[i] && i < 14; i++) {
+        argv[i + 1] = args[i];
+    }
+    int out[2];
+    if (pipe(out) < 0) {
+        err(1, "pipe");
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        err(1, "fork");
+    }
+    if (pid == 0) {
+        if (dup2(in_fd, STDIN_FILENO) < 0 || dup2(out[1], STDOUT_FILENO) < 0) {
+            err(1, "Failed to set up %s", program);
+        }
+        close(out[0]);
+        close(out[1]);
+        execv(program, argv);
+        err(127, "Failed to run %s", program);
+    }
+    close(out[1]);
+    char *output = (char *)read_rest(out[0], size);
+    close(out[0]);
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) err(1, "waitpid");
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        errx(1, "%s failed (status %#x)", program, status);
+    }
+    return output;
+}
+
+/* Compare the output with the default encoding of expected[0, len), between head and trailer if not NULL
+*/
+static void check(char const *what, char const *output, size_t size, char const *head, uint8_t const *expected,
+                  size_t len, char const *trailer) {
+    struct b64_options opts = B64_OPTIONS_MIME;
+    size_t n_head = head ? strlen(head) : 0, n_trailer = trailer ? strlen(trailer) : 0;
+    size_t n = n_head + b64_encoded_size(&opts, len);
+    char *encoded = malloc(n + n_trailer);
+    if (!encoded) {
+        err(1, "Memory allocation failed");
+    }
+    memcpy(encoded, head, n_head);
+    b64_encode_buf(&opts, expected, len, encoded + n_head);
+    memcpy(encoded + n, trailer, n_trailer);
+    bool ok = size == n + n_trailer && memcmp(output, encoded, size) == 0;
+    failures += !ok;
+    printf("%-44s %8zu bytes in %9zu out  %s\n", what, len, size, ok ? "ok" : "FAIL");
+    free(encoded);
+}
+
+/* A file in /proc, whose reported size is 0: path must read the same from any process
+*/
+static void check_proc(char const *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        err(1, "Failed to open file: %s", path);
+    }
+    size_t len, size;
+    uint8_t *expected = read_rest(fd, &len);
+    close(fd);
+
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        err(1, "Failed to stat file: %s", path);
+    }
+    char what[64], head[128], trailer[128];
+    char *output = run((char *[]){(char *)path, NULL}, STDIN_FILENO, &size);
+    snprintf(what, sizeof(what), "%s", path);
+    check(what, output, size, NULL, expected, len, NULL);
+    free(output);
+
+    output = run((char *[]){"-j", "4", (char *)path, NULL}, STDIN_FILENO, &size);
+    snprintf(what, sizeof(what), "-j 4 %s", path);
+    check(what, output, size, NULL, expected, len, NULL);
+    free(output);
+
+    output = run((char *[]){"--crc32c", "--trailer", (char *)path, NULL}, STDIN_FILENO, &size);
+    snprintf(what, sizeof(what), "--crc32c --trailer %s", path);
+    snprintf(trailer, sizeof(trailer), "CRC32C (%s) = %08x\n", path, crc32c(0, expected, len));
+    check(what, output, size, NULL, expected, len, trailer);
+    free(output);
+
+    // Batch mode: a one-path --files-from list on stdin, and one frame out
+    char list[] = "/tmp/b64check.XXXXXX";
+    int list_fd = mkstemp(list);
+    if (list_fd < 0 || write(list_fd, path, strlen(path) + 1) < 0 || lseek(list_fd, 0, SEEK_SET) != 0) {
+        err(1, "Failed to create a path list");
+    }
+    unlink(list);
+    output = run((char *[]){"--files-from=-", NULL}, list_fd, &size);
+    close(list_fd);
+    snprintf(what, sizeof(what), "--files-from %s", path);
+    snprintf(head, sizeof(head), "begin-base64 %03o %s\n", st.st_mode & 0777, path);
+    check(what, output, size, head, expected, len, "====\n");
+    free(output);
+    free(expected);
+}
+
+/* path on stdin with offset bytes of it read already, encoded on threads threads
+*/
+static void check_offset(char const *path, uint8_t const *data, size_t len, off_t offset, char *threads) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || lseek(fd, offset, SEEK_SET) != offset) {
+        err(1, "Failed to open file: %s", path);
+    }
+    size_t size;
+    char *output = run((char *[]){"-j", threads, NULL}, fd, &size);
+    close(fd);
+    char what[64];
+    snprintf(what, sizeof(what), "-j %s, stdin at offset %lld of %zu", threads, (long long)offset, len);
+    check(what, output, size, NULL, data + offset, len - offset, NULL);
+    free(output);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        errx(1, "Usage: %s [BASE64]", argv[0]);
+    }
+    if (argc == 2) {
+        program = argv[1];
+    }
+
+    check_proc("/proc/version");
+
+    uint8_t *data = malloc(CHECK_LARGE_SIZE);
+    if (!data) {
+        err(1, "Memory allocation failed");
+    }
+    for (size_t i = 0; i < CHECK_LARGE_SIZE; i++) {
+        data[i] = (uint8_t)(i * 2654435761u >> 13);
+    }
+    static size_t const sizes[] = {CHECK_SMALL_SIZE, CHECK_LARGE_SIZE};
+    static off_t const offsets[] = {0, 1, 100, CHECK_SMALL_SIZE, 4096, 5000}; /* The small file's size: nothing left */
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        char path[] = "/tmp/b64check.XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0 || write(fd, data, sizes[s]) != (ssize_t)sizes[s]) {
+            err(1, "Failed to create a test file");
+        }
+        close(fd);
+        for (size_t o = 0; o < sizeof(offsets) / sizeof(offsets[0]); o++) {
+            if ((size_t)offsets[o] <= sizes[s]) {
+                check_offset(path, data, sizes[s], offsets[o], "1");
+                check_offset(path, data, sizes[s], offsets[o], "4");
+            }
+        }
+        unlink(path);
+    }
+    free(data);
+
+    if (failures > 0) {
+        printf("b64check: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("b64check: all checks passed\n");
+    return 0;
+}
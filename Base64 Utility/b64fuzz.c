@@ -0,0 +1,230 @@
+/* Differential fuzz harness for libb64: every backend (each SIMD kernel one-shot and streamed in random
+   pieces, the threaded encoder, and the mmap-style chunked encoder over a mapped file) must produce exactly
+   the scalar kernel's output, and every decoder must agree with the scalar decoder on arbitrary input,
+   including where and why it fails.
+
+   Built standalone it feeds itself random inputs:   b64fuzz [ITERATIONS] [SEED]
+   Built with -DB64_LIBFUZZER it is a libFuzzer target (clang -fsanitize=fuzzer).
+*/
+
+#include <stdio.h>      // Standard input and output
+#include <stdlib.h>     // malloc(), free(), abort()
+#include <stdint.h>     // Extra fixed-width data types
+#include <string.h>     // memcmp(), memcpy()
+#include <err.h>        // Convenience functions for error reporting (non-standard)
+#include <stdbool.h>    // Boolean type and values
+#include <time.h>       // time() for the default seed
+#include <unistd.h>     // ftruncate(), pwrite()
+#include <sys/mman.h>   // mmap() for the mmap backend
+
+#include "libb64.h"
+
+#define FUZZ_MAX_SPLIT 97                                   /* Largest piece fed to update() by the streamed backends */
+
+// Wrap widths the first input byte chooses from: none, MIME, and widths that hit every wrap-mode encoder
+static size_t const fuzz_widths[] = {0, B64_LINE_CHARS, 64, 70, 4, 1, 3, 5};
+
+/* Report a mismatch and abort(), so libFuzzer keeps the input as a crash
+*/
+static void fuzz_fail(char const *what, char const *kernel, struct b64_options const *opts, size_t len) {
+    fprintf(stderr, "b64fuzz: %s (kernel %s, url=%d pad=%d wrap=%zu newline=%d, %zu bytes)\n", what, kernel,
+            opts->url, opts->pad, opts->line_chars, opts->final_newline, len);
+    abort();
+}
+
+/* Deterministic piece sizes derived from the input, so a crash reproduces from the input alone
+*/
+static size_t next_split(uint32_t *state) {
+    *state = *state * 1103515245u + 12345u;
+    return (*state >> 16) % (FUZZ_MAX_SPLIT + 1);
+}
+
+static size_t encode_streamed(struct b64_options const *opts, uint8_t const *in, size_t len, char *out, uint32_t seed) {
+    struct b64_encoder enc;
+    size_t n_out = 0;
+    b64_encoder_init(&enc, opts);
+    for (size_t off = 0; off < len; ) {
+        size_t n = next_split(&seed);
+        if (n > len - off) {
+            n = len - off;
+        }
+        n_out += b64_encoder_update(&enc, in + off, n, out + n_out);
+        off += n;
+    }
+    return n_out + b64_encoder_final(&enc, out + n_out);
+}
+
+/* The base64 utility's regular-file path: map the input and feed the encoder from the mapping
+*/
+static size_t encode_mapped(struct b64_options const *opts, uint8_t const *in, size_t len, char *out, uint32_t seed) {
+    static FILE *file;
+    if (len == 0) {
+        return b64_encode_buf(opts, in, len, out);          /* mmap() rejects empty mappings */
+    }
+    if (!file && !(file = tmpfile())) {
+        err(1, "Failed to create the mmap backend file");
+    }
+    int fd = fileno(file);
+    if (ftruncate(fd, 0) < 0 || pwrite(fd, in, len, 0) != (ssize_t)len) {
+        err(1, "Failed to write the mmap backend file");
+    }
+    uint8_t *mapped = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        err(1, "Failed to map the mmap backend file");
+    }
+    size_t n_out = encode_streamed(opts, mapped, len, out, seed);
+    munmap(mapped, len);
+    return n_out;
+}
+
+static bool same_decode(bool ok_a, struct b64_decoder const *a, uint8_t const *out_a, size_t n_a,
+                        bool ok_b, struct b64_decoder const *b, uint8_t const *out_b, size_t n_b) {
+    if (ok_a != ok_b) return false;
+    if (!ok_a) return a->error == b->error && a->error_offset == b->error_offset;
+    return n_a == n_b && !memcmp(out_a, out_b, n_a);
+}
+
+/* One fuzz case. The first byte picks the output variant; the rest is both the data to encode and, read
+   as text, the data to decode.
+*/
+int LLVMFuzzerTestOneInput(uint8_t const *data, size_t size) {
+    if (size == 0) return 0;
+    struct b64_options opts = {
+        .url = data[0] & 1,
+        .pad = !(data[0] & 2),
+        .line_chars = fuzz_widths[data[0] >> 2 & 7],
+        .final_newline = !(data[0] & 0x20),
+    };
+    uint8_t const *in = data + 1;
+    size_t len = size - 1;
+    uint32_t seed = size * 2654435761u ^ data[0];
+
+    size_t n_encoded = b64_encoded_size(&opts, len);
+    size_t cap = b64_encode_bound(&opts, len) + B64_FINAL_MAX;
+    char *expected = malloc(cap);
+    char *actual = malloc(cap);
+    uint8_t *decoded = malloc(b64_decode_bound(cap > len ? cap : len));
+    uint8_t *reference = malloc(b64_decode_bound(cap > len ? cap : len));
+    if (!expected || !actual || !decoded || !reference) {
+        err(1, "Memory allocation failed");
+    }
+
+    b64_use_kernel("scalar");
+    size_t n_expected = b64_encode_buf(&opts, in, len, expected);
+    if (n_expected != n_encoded) {
+        fuzz_fail("encoded size differs from b64_encoded_size()", "scalar", &opts, len);
+    }
+    struct b64_decoder ref;
+    size_t n_reference;
+    bool ref_ok = b64_decode_buf(&ref, &opts, (char const *)in, len, reference, &n_reference);
+
+    for (char const *const *k = b64_kernel_names; *k; k++) {
+        if (!b64_use_kernel(*k)) continue;
+
+        if (b64_encode_buf(&opts, in, len, actual) != n_expected || memcmp(actual, expected, n_expected)) {
+            fuzz_fail("one-shot encode differs from scalar", *k, &opts, len);
+        }
+        if (encode_streamed(&opts, in, len, actual, seed) != n_expected || memcmp(actual, expected, n_expected)) {
+            fuzz_fail("streamed encode differs from scalar", *k, &opts, len);
+        }
+        if (encode_mapped(&opts, in, len, actual, seed) != n_expected || memcmp(actual, expected, n_expected)) {
+            fuzz_fail("mmap encode differs from scalar", *k, &opts, len);
+        }
+        int n_threads = 2 + seed % 3;
+        if (b64_encode_buf_parallel(&opts, in, len, actual, n_threads) != n_expected || memcmp(actual, expected, n_expected)) {
+            fuzz_fail("threaded encode differs from scalar", *k, &opts, len);
+        }
+
+        // Round trip of valid input
+        struct b64_decoder dec;
+        size_t n_decoded;
+        if (!b64_decode_buf(&dec, &opts, expected, n_expected, decoded, &n_decoded) || n_decoded != len || memcmp(decoded, in, len)) {
+            fuzz_fail("decode does not round-trip", *k, &opts, len);
+        }
+
+        // Arbitrary input read as text, one-shot and in pieces
+        bool ok = b64_decode_buf(&dec, &opts, (char const *)in, len, decoded, &n_decoded);
+        if (!same_decode(ok, &dec, decoded, n_decoded, ref_ok, &ref, reference, n_reference)) {
+            fuzz_fail("decoder disagrees with scalar", *k, &opts, len);
+        }
+        uint32_t split_seed = seed;
+        size_t n_piece;
+        b64_decoder_init(&dec, &opts);
+        ok = true;
+        n_decoded = 0;
+        for (size_t off = 0; ok && off < len; ) {
+            size_t n = next_split(&split_seed);
+            if (n > len - off) {
+                n = len - off;
+            }
+            ok = b64_decoder_update(&dec, (char const *)in + off, n, decoded + n_decoded, &n_piece);
+            n_decoded += n_piece;
+            off += n;
+        }
+        if (ok) {
+            ok = b64_decoder_final(&dec, decoded + n_decoded, &n_piece);
+            n_decoded += n_piece;
+        }
+        if (!same_decode(ok, &dec, decoded, ok ? n_decoded : 0, ref_ok, &ref, reference, ok ? n_reference : 0)) {
+            fuzz_fail("streamed decoder disagrees with scalar", *k, &opts, len);
+        }
+    }
+    b64_use_kernel(b64_kernel_names[0]);
+
+    free(expected);
+    free(actual);
+    free(decoded);
+    free(reference);
+    return 0;
+}
+
+#ifndef B64_LIBFUZZER
+/* Standalone driver: random variants and lengths, mostly short (every kernel edge case lives in the first
+   few hundred bytes) with an occasional long one; half of the inputs are drawn from Base64 characters so
+   the decoders get past the first byte.
+*/
+int main(int argc, char *argv[]) {
+    static char const charset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/-_=\n";
+    if (argc > 3) {
+        errx(1, "Usage: %s [ITERATIONS] [SEED]", argv[0]);
+    }
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    unsigned seed = argc > 2 ? strtoul(argv[2], NULL, 10) : (unsigned)time(0);
+    srand(seed);
+
+    enum { MAX_LEN = 1 << 16 };
+    uint8_t *buf = malloc(MAX_LEN + 1);
+    uint8_t *raw = malloc(MAX_LEN);
+    char *scratch = malloc(b64_encode_bound(&B64_OPTIONS_MIME, MAX_LEN) + B64_FINAL_MAX);
+    if (!buf || !raw || !scratch) {
+        err(1, "Memory allocation failed");
+    }
+    for (size_t j = 0; j < MAX_LEN; j++) {
+        raw[j] = rand() & 0xFF;
+    }
+    for (unsigned long i = 0; i < iterations; i++) {
+        size_t len = rand() % 16 == 0 ? rand() % MAX_LEN : rand() % 512;
+        bool text = rand() & 1;
+        buf[0] = rand() & 0xFF;
+        for (size_t j = 1; j <= len; j++) {
+            buf[j] = text ? charset[rand() % (sizeof(charset) - 1)] : rand() & 0xFF;
+        }
+        // Valid encodings, cut to length and sometimes with one character replaced, are the interesting
+        // decoder cases
+        if (text && rand() % 2 == 0) {
+            struct b64_options opts = {.url = buf[0] & 1, .pad = true, .line_chars = B64_LINE_CHARS, .final_newline = true};
+            size_t n = b64_encode_buf(&opts, raw, len * 3 / 4, scratch);
+            memcpy(buf + 1, scratch, n < len ? n : len);
+            if (len > 0 && rand() % 2 == 0) {
+                buf[1 + rand() % len] = charset[rand() % (sizeof(charset) - 1)];
+            }
+        }
+        LLVMFuzzerTestOneInput(buf, len + 1);
+    }
+    printf("b64fuzz: %lu cases passed (seed %u)\n", iterations, seed);
+    free(buf);
+    free(raw);
+    free(scratch);
+    return 0;
+}
+#endif
@@ -1,102 +1,798 @@
 // Previously attempted course in Fall 2023.
 
-#include <stdio.h>      // Standard input and output 
-#include <errno.h>      // Access to errno and Exxx macros 
-#include <stdint.h>     // Extra fixed-width data types 
-#include <string.h>     // String utilities 
+#define _GNU_SOURCE     // vmsplice() and F_SETPIPE_SZ on Linux
+
+#include <stdio.h>      // Standard input and output
+#include <stdlib.h>     // malloc(), free(), strtoul()
+#include <errno.h>      // Access to errno and Exxx macros
+#include <stdint.h>     // Extra fixed-width data types
+#include <string.h>     // String utilities
 #include <err.h>        // Convenience functions for error reporting (non-standard)
 #include <stdbool.h>    // Boolean type and values
+#include <unistd.h>     // read(), write(), close()
+#include <fcntl.h>      // open()
+#include <getopt.h>     // getopt_long()
+#include <limits.h>     // PATH_MAX
+#include <pthread.h>    // Batch worker pool
+#include <signal.h>     // SIGBUS from a mapped input that shrank
+#include <sys/mman.h>   // mmap()
+#include <sys/stat.h>   // fstat()
+#include <sys/resource.h> // getrusage() page-fault counts for --stats
+#include <sys/uio.h>    // struct iovec, vmsplice()
+
+#include "libb64.h"     // Encoder, decoder and SIMD kernels
+#include "checksum.h"   // CRC32C and XXH64 for --crc32c and --xxhash
+
+#define B64_MAX_WRAP    1000000                             /* Largest -w width: keeps a wrap unit (lcm(width, 4) chars) small */
+#define B64_BLOCK_SIZE  65536                               /* Streaming: 64 KiB of input per read() */
+#define B64_MAP_SIZE    (1 << 20)                           /* mmap backend: 1 MiB of mapped input encoded per output chunk */
+#define B64_PIPE_SIZE   (1 << 20)                           /* Pipe buffer requested before vmsplice(): fewer, larger splices */
+#define B64_ALIGN       4096                                /* Page-aligned I/O buffers */
+#define B64_FRAME_ROOM  (PATH_MAX + 64)                     /* Batch output buffers also hold a frame header */
+
+static struct b64_options format = B64_OPTIONS_MIME;        /* Output variant chosen on the command line */
+
+// Checksums of the raw input chosen on the command line, computed in the same pass as the encoding
+static struct {
+    bool crc32c;                                            /* --crc32c */
+    bool xxhash;                                            /* --xxhash: XXH64, seed 0 */
+    bool trailer;                                           /* --trailer: digest lines follow the encoded output instead of going to stderr */
+} digests;
+
+// Running checksums of one input
+struct digest {
+    uint32_t crc;
+    struct xxh64_state xxh;
+};
+
+// System calls issued on the data path, reported by --stats
+static struct {
+    _Atomic unsigned long reads;                            /* Atomic: batch workers share the counters */
+    _Atomic unsigned long writes;
+    _Atomic unsigned long vmsplices;
+    _Atomic unsigned long mmaps;
+    _Atomic unsigned long munmaps;
+} io_stats;
+
+/* Read until len bytes have been read or end of file. Returns the number of bytes read.
+*/
+static size_t read_full(int fd, void *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = read(fd, (char *)buf + total, len - total);
+        io_stats.reads++;
+        if (n == 0) break;                                  /* End of file */
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            err(1, "Read error");                           /* Read error */
+        }
+        total += n;
+    }
+    return total;
+}
+
+/* Write all len bytes, retrying after short writes and interrupted system calls.
+*/
+static void write_full(int fd, void const *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        io_stats.writes++;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            err(1, "Write error");                          /* Write error */
+        }
+        buf = (char const *)buf + n;
+        len -= n;
+    }
+}
+
+/* mmap()/munmap() wrappers that count calls for --stats
+*/
+static void *map_or_die(size_t len, int prot, int flags, int fd, char const *what) {
+    void *p = mmap(NULL, len, prot, flags, fd, 0);
+    io_stats.mmaps++;
+    if (p == MAP_FAILED) {
+        err(1, "Failed to map %s", what);
+    }
+    return p;
+}
+
+static void unmap(void *p, size_t len) {
+    munmap(p, len);
+    io_stats.munmaps++;
+}
+
+/* Map size bytes of in_fd from offset start, which need not be page-aligned. *base and *base_len get what
+   to unmap afterwards.
+*/
+static uint8_t *map_input(int in_fd, off_t start, size_t size, void **base, size_t *base_len) {
+    off_t aligned = start & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    void *p = mmap(NULL, size + (start - aligned), PROT_READ, MAP_PRIVATE, in_fd, aligned);
+    io_stats.mmaps++;
+    if (p == MAP_FAILED) {
+        err(1, "Failed to map input");
+    }
+    *base = p;
+    *base_len = size + (start - aligned);
+    return (uint8_t *)p + (start - aligned);
+}
+
+/* SIGBUS handler: a mapped input was truncated under us, so the pages past its new end are gone. Report it
+   and fail instead of dumping core; the output written so far is incomplete either way.
+*/
+static void input_shrank(int sig) {
+    static char const msg[] = "base64: Input file shrank while being encoded\n";
+    (void)sig;
+    if (write(STDERR_FILENO, msg, sizeof(msg) - 1) < 0) {
+        /* Nothing more to do: exiting anyway */
+    }
+    _exit(1);
+}
+
+/* True if fd is a pipe, i.e. output can be handed over with vmsplice() instead of copied by write()
+*/
+static bool is_pipe(int fd) {
+#ifdef __linux__
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+#else
+    (void)fd;
+    return false;
+#endif
+}
+
+/* Write len bytes to a pipe by splicing the user pages into it rather than copying them. The pipe keeps
+   references to the pages, so the caller must not modify buf afterwards; unmapping it is fine.
+   Falls back to write_full() if the kernel refuses.
+*/
+static void vmsplice_full(int fd, char const *buf, size_t len) {
+#ifdef __linux__
+    while (len > 0) {
+        struct iovec iov = {(void *)buf, len};
+        ssize_t n = vmsplice(fd, &iov, 1, 0);
+        io_stats.vmsplices++;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL || errno == ENOSYS) break;
+            err(1, "Write error");
+        }
+        buf += n;
+        len -= n;
+    }
+#endif
+    write_full(fd, buf, len);
+}
+
+/* Output buffer for one descriptor, reused across files. Encoders reserve room and encode straight into
+   it; it is written out when a reservation does not fit and at the end of the run (or of each output
+   file). Batch workers writing framed output to one stdout share a lock so frames never interleave: a
+   worker takes it on its first write inside a frame and keeps it until that frame is complete, so buffers
+   holding only whole frames are written without waiting on other workers' large files.
+*/
+struct sink {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+    pthread_mutex_t *lock;                                  /* NULL = only writer of fd */
+    bool holding;
+};
+
+static void sink_flush(struct sink *sink) {
+    if (sink->lock && !sink->holding) {
+        pthread_mutex_lock(sink->lock);
+        sink->holding = true;
+    }
+    if (sink->len > 0) {
+        write_full(sink->fd, sink->buf, sink->len);
+        sink->len = 0;
+    }
+}
+
+/* End of a frame: release the output if a write inside the frame took it
+*/
+static void sink_end_frame(struct sink *sink) {
+    if (sink->holding) {
+        sink_flush(sink);
+        pthread_mutex_unlock(sink->lock);
+        sink->holding = false;
+    }
+}
+
+/* Room for n bytes (n <= cap) at the end of the buffer; sink_commit() then keeps what was used
+*/
+static char *sink_reserve(struct sink *sink, size_t n) {
+    if (sink->cap - sink->len < n) {
+        sink_flush(sink);
+    }
+    return sink->buf + sink->len;
+}
+
+static void sink_commit(struct sink *sink, size_t n) {
+    sink->len += n;
+}
+
+static void *alloc_aligned(size_t len) {
+    void *p;
+    if (posix_memalign(&p, B64_ALIGN, len) != 0) {
+        err(1, "Memory allocation failed");
+    }
+    return p;
+}
+
+static void digest_init(struct digest *dg) {
+    dg->crc = 0;
+    xxh64_init(&dg->xxh, 0);
+}
+
+static void digest_update(struct digest *dg, void const *buf, size_t len) {
+    if (!dg) return;
+    if (digests.crc32c) {
+        dg->crc = crc32c(dg->crc, buf, len);
+    }
+    if (digests.xxhash) {
+        xxh64_update(&dg->xxh, buf, len);
+    }
+}
+
+/* Encode len bytes with dg (if any) checksumming them on the way, in 64 KiB steps so each step is still in
+   cache when the encoder reads it: one pass over the input instead of an encode pass and a checksum pass
+*/
+static size_t encode_update(struct b64_encoder *enc, struct digest *dg, uint8_t const *in, size_t len, char *out) {
+    if (!dg) {
+        return b64_encoder_update(enc, in, len, out);
+    }
+    size_t n_out = 0;
+    for (size_t off = 0; off < len; off += B64_BLOCK_SIZE) {
+        size_t n = len - off < B64_BLOCK_SIZE ? len - off : B64_BLOCK_SIZE;
+        digest_update(dg, in + off, n);
+        n_out += b64_encoder_update(enc, in + off, n, out + n_out);
+    }
+    return n_out;
+}
+
+/* Reserve size for one block-streaming read */
+#define STREAM_RESERVE (b64_encode_bound(&format, B64_BLOCK_SIZE) + B64_FINAL_MAX)
+
+/* Block-streaming encoder: one read() of 64 KiB, one pass over the block straight into the output buffer.
+   The encoder carries partial groups and the line position from one block to the next.
+*/
+static uint64_t encode_stream(int in_fd, uint8_t *in_buf, struct sink *sink, struct digest *dg) {
+    struct b64_encoder enc;
+    b64_encoder_init(&enc, &format);
+    uint64_t total = 0;
+    for (;;) {
+        size_t n_read = read_full(in_fd, in_buf, B64_BLOCK_SIZE);
+        total += n_read;
+        bool last = n_read < B64_BLOCK_SIZE;                /* A short block is always the last one */
+
+        char *out = sink_reserve(sink, STREAM_RESERVE);
+        size_t n_out = encode_update(&enc, dg, in_buf, n_read, out);
+        if (last) {
+            n_out += b64_encoder_final(&enc, out + n_out);
+        }
+        sink_commit(sink, n_out);
+
+        if (last) break;
+    }
+    return total;
+}
+
+/* Zero-copy encoder for a regular file: map the size bytes from offset start on with MADV_SEQUENTIAL
+   read-ahead and encode straight from the mapping, 1 MiB of input at a time. Pipes get each chunk through
+   vmsplice() from a fresh mapping that is unmapped (never rewritten) afterwards; anything else goes through
+   the output buffer. Leaves the file offset at the end of what was encoded, as reading it would.
+*/
+static void encode_mapped(int in_fd, off_t start, size_t size, struct sink *sink, struct digest *dg) {
+    void *base;
+    size_t base_len;
+    uint8_t *in = map_input(in_fd, start, size, &base, &base_len);
+    madvise(base, base_len, MADV_SEQUENTIAL);
+
+    bool splice = is_pipe(sink->fd);
+    if (splice) {
+        sink_flush(sink);                                   /* Everything buffered goes first */
+#ifdef __linux__
+        fcntl(sink->fd, F_SETPIPE_SZ, B64_PIPE_SIZE);       /* Best effort: limited by /proc/sys/fs/pipe-max-size */
+#endif
+    }
+    size_t out_size = b64_encode_bound(&format, B64_MAP_SIZE) + B64_FINAL_MAX;
+
+    struct b64_encoder enc;
+    b64_encoder_init(&enc, &format);
+    for (size_t off = 0; off < size; off += B64_MAP_SIZE) {
+        size_t len = size - off < B64_MAP_SIZE ? size - off : B64_MAP_SIZE;
+        char *out = splice ? map_or_die(out_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, "output")
+                           : sink_reserve(sink, out_size);
+        size_t n_out = encode_update(&enc, dg, in + off, len, out);
+        if (off + len == size) {
+            n_out += b64_encoder_final(&enc, out + n_out);
+        }
+        if (splice) {
+            vmsplice_full(sink->fd, out, n_out);
+            unmap(out, out_size);
+        } else {
+            sink_commit(sink, n_out);
+        }
+    }
+
+    unmap(base, base_len);
+    lseek(in_fd, start + size, SEEK_SET);
+}
+
+/* Parallel encoder for a regular file of known size: mmap the size bytes from offset start on, encode them
+   on n_threads threads straight into one output mapping, and write the result out in one go (vmsplice()
+   for pipes). Leaves the file offset at the end of what was encoded.
+*/
+static void encode_parallel(int in_fd, off_t start, size_t size, struct sink *sink, int n_threads) {
+    void *base;
+    size_t base_len;
+    uint8_t *in = map_input(in_fd, start, size, &base, &base_len);
+    size_t out_size = b64_encoded_size(&format, size);
+    char *out = map_or_die(out_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, "output");
+
+    b64_encode_buf_parallel(&format, in, size, out, n_threads);
+
+    sink_flush(sink);
+    if (is_pipe(sink->fd)) {
+#ifdef __linux__
+        fcntl(sink->fd, F_SETPIPE_SZ, B64_PIPE_SIZE);
+#endif
+        vmsplice_full(sink->fd, out, out_size);
+    } else {
+        write_full(sink->fd, out, out_size);
+    }
+
+    unmap(out, out_size);
+    unmap(base, base_len);
+    lseek(in_fd, start + size, SEEK_SET);
+}
+
+/* Encode one open input with the backend that suits it: regular files of a block or more from an mmap()
+   (on -j threads if requested), from the current file offset on, so a stdin that was partly read already is
+   encoded from where it stands. Everything else goes through the streaming reader, which reads until end of
+   file whatever size fstat() gave: pipes and terminals, which have no size to map or split up front, files
+   that report a size of 0 (those in /proc and /sys, whose contents exist only as they are read), and small
+   files, for which a mapping costs more to set up and tear down than reading them, which matters for
+   batches of small files. Returns the number of input bytes encoded.
+*/
+static uint64_t encode_fd(int in_fd, uint8_t *in_buf, struct sink *sink, int n_threads, struct digest *dg) {
+    struct stat st;
+    off_t start = -1;
+    bool regular = fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= B64_BLOCK_SIZE
+                && (start = lseek(in_fd, 0, SEEK_CUR)) >= 0 && st.st_size - start >= B64_BLOCK_SIZE;
+    size_t size = regular ? st.st_size - start : 0;
+    if (regular && n_threads > 1 && !dg) {                  /* Checksums need the input in order: single pass instead */
+        encode_parallel(in_fd, start, size, sink, n_threads);
+    } else if (regular) {
+        encode_mapped(in_fd, start, size, sink, dg);
+    } else {
+        return encode_stream(in_fd, in_buf, sink, dg);
+    }
+    return size;
+}
+
+/* Start a new line unless the output of n_in input bytes already ended one (only --raw output does not)
+*/
+static void end_line(struct sink *sink, uint64_t n_in) {
+    if (n_in > 0 && !format.final_newline) {
+        *sink_reserve(sink, 1) = '\n';
+        sink_commit(sink, 1);
+    }
+}
+
+/* Report the checksums of one input in BSD tagged style, "CRC32C (path) = 1a2b3c4d", on stderr or, with
+   --trailer, as lines in the output
+*/
+static void report_digest(struct digest const *dg, char const *path, struct sink *sink) {
+    char line[PATH_MAX + 64];
+    size_t n = 0;
+    if (digests.crc32c) {
+        n += snprintf(line + n, sizeof(line) - n, "CRC32C (%s) = %08x\n", path, dg->crc);
+    }
+    if (digests.xxhash && n < sizeof(line)) {
+        n += snprintf(line + n, sizeof(line) - n, "XXH64 (%s) = %016llx\n", path, (unsigned long long)xxh64_digest(&dg->xxh));
+    }
+    n = n < sizeof(line) ? n : sizeof(line) - 1;
+    if (digests.trailer) {
+        memcpy(sink_reserve(sink, n), line, n);
+        sink_commit(sink, n);
+    } else {
+        fwrite(line, 1, n, stderr);
+    }
+}
+
+/* Batch mode: many inputs in one process. Each input is encoded either into <path>.b64 or, on stdout, as
+   a uuencode -m style frame:
+
+       begin-base64 <mode> <path>
+       <encoded data>
+       ====
+
+   With --trailer the checksum lines follow the "====" line. Each worker owns one aligned input buffer and
+   one output buffer, reused for every file it takes.
+*/
+struct batch {
+    char **paths;
+    size_t n_paths;
+    size_t next;                                            /* Index of the next path to take, shared by the workers */
+    bool to_files;                                          /* --to-files: <path>.b64 instead of frames on stdout */
+    pthread_mutex_t out_lock;                               /* Framed stdout shared by the workers */
+    int status;                                             /* Exit status: 1 once any input failed */
+};
 
-static char const b64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ" 
-                                   "abcdefghijklmnopqrstuvwxyz" 
-                                   "0123456789" 
-                                   "+/";  
+struct batch_worker {
+    struct batch *batch;
+    uint8_t *in_buf;
+    struct sink sink;
+};
 
-// int argc - represents the number of items entered on the command line. 
+static void batch_encode_one(struct batch_worker *w, char const *path) {
+    struct batch *batch = w->batch;
+    struct digest digest, *dg = digests.crc32c || digests.xxhash ? &digest : NULL;
+    if (dg) {
+        digest_init(dg);
+    }
+    bool is_stdin = !strcmp(path, "-");
+    int in_fd = is_stdin ? STDIN_FILENO : open(path, O_RDONLY);
+    if (in_fd < 0) {
+        warn("Failed to open file: %s", path);
+        __atomic_store_n(&batch->status, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (batch->to_files) {
+        char out_path[PATH_MAX];
+        if (is_stdin || snprintf(out_path, sizeof(out_path), "%s.b64", path) >= (int)sizeof(out_path)) {
+            warnx("No output file name for: %s", path);
+            __atomic_store_n(&batch->status, 1, __ATOMIC_RELAXED);
+        } else if ((w->sink.fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+            warn("Failed to create file: %s", out_path);
+            __atomic_store_n(&batch->status, 1, __ATOMIC_RELAXED);
+        } else {
+            uint64_t n_in = encode_fd(in_fd, w->in_buf, &w->sink, 1, dg);
+            if (dg) {
+                if (digests.trailer) {
+                    end_line(&w->sink, n_in);
+                }
+                report_digest(dg, path, &w->sink);
+            }
+            sink_flush(&w->sink);
+            close(w->sink.fd);
+        }
+    } else if (strchr(path, '\n')) {
+        warnx("Cannot frame a path containing a newline: %s", path);
+        __atomic_store_n(&batch->status, 1, __ATOMIC_RELAXED);
+    } else {
+        struct stat st;
+        unsigned mode = fstat(in_fd, &st) == 0 ? st.st_mode & 0777 : 0644;
+        size_t room = strlen(path) + 32;
+        char *head = sink_reserve(&w->sink, room);
+        sink_commit(&w->sink, snprintf(head, room, "begin-base64 %03o %s\n", mode, path));
+
+        uint64_t n_in = encode_fd(in_fd, w->in_buf, &w->sink, 1, dg);
+
+        // Frames end on a line of their own even when the encoding has no final newline (--raw)
+        end_line(&w->sink, n_in);
+        memcpy(sink_reserve(&w->sink, 5), "====\n", 5);
+        sink_commit(&w->sink, 5);
+        if (dg) {
+            report_digest(dg, path, &w->sink);
+        }
+        sink_end_frame(&w->sink);
+    }
+
+    if (!is_stdin) {
+        close(in_fd);
+    }
+}
+
+static void *batch_worker_run(void *arg) {
+    struct batch_worker *w = arg;
+    struct batch *batch = w->batch;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (i >= batch->n_paths) break;
+        batch_encode_one(w, batch->paths[i]);
+    }
+    if (!batch->to_files) {
+        sink_flush(&w->sink);
+        sink_end_frame(&w->sink);
+    }
+    return NULL;
+}
+
+/* Encode every path on n_workers threads (the calling thread alone when 1). Returns the exit status.
+*/
+static int encode_batch(char **paths, size_t n_paths, bool to_files, int n_workers) {
+    struct batch batch = {.paths = paths, .n_paths = n_paths, .to_files = to_files};
+    pthread_mutex_init(&batch.out_lock, NULL);
+    if ((size_t)n_workers > n_paths) {
+        n_workers = n_paths > 0 ? n_paths : 1;
+    }
+
+    struct batch_worker *workers = calloc(n_workers, sizeof(*workers));
+    pthread_t *threads = malloc(n_workers * sizeof(*threads));
+    if (!workers || !threads) {
+        err(1, "Memory allocation failed");
+    }
+    size_t cap = b64_encode_bound(&format, B64_MAP_SIZE) + B64_FINAL_MAX + B64_FRAME_ROOM;
+    for (int t = 0; t < n_workers; t++) {
+        workers[t].batch = &batch;
+        workers[t].in_buf = alloc_aligned(B64_BLOCK_SIZE);
+        workers[t].sink = (struct sink){.fd = STDOUT_FILENO, .buf = alloc_aligned(cap), .cap = cap,
+                                        .lock = n_workers > 1 && !to_files ? &batch.out_lock : NULL};
+    }
+
+    if (n_workers == 1) {
+        batch_worker_run(&workers[0]);
+    } else {
+        for (int t = 0; t < n_workers; t++) {
+            int rc = pthread_create(&threads[t], NULL, batch_worker_run, &workers[t]);
+            if (rc != 0) {
+                errno = rc;
+                err(1, "Failed to create worker thread");
+            }
+        }
+        for (int t = 0; t < n_workers; t++) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+
+    for (int t = 0; t < n_workers; t++) {
+        free(workers[t].in_buf);
+        free(workers[t].sink.buf);
+    }
+    free(workers);
+    free(threads);
+    pthread_mutex_destroy(&batch.out_lock);
+    return batch.status;
+}
+
+/* --files-from: append the NUL-separated paths in list_path ("-" = stdin) to *paths
+*/
+static void read_path_list(char const *list_path, char ***paths, size_t *n_paths, size_t *cap) {
+    FILE *list = strcmp(list_path, "-") ? fopen(list_path, "r") : stdin;
+    if (!list) {
+        err(1, "Failed to open file: %s", list_path);
+    }
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t n;
+    while ((n = getdelim(&line, &line_cap, '\0', list)) > 0) {
+        if (line[0] == '\0') continue;                      /* getdelim() terminates the last entry even without a NUL */
+        if (*n_paths == *cap) {
+            *cap = *cap ? *cap * 2 : 64;
+            *paths = realloc(*paths, *cap * sizeof(**paths));
+            if (!*paths) {
+                err(1, "Memory allocation failed");
+            }
+        }
+        if (!((*paths)[(*n_paths)++] = strdup(line))) {
+            err(1, "Memory allocation failed");
+        }
+    }
+    if (ferror(list)) {
+        err(1, "Read error");
+    }
+    free(line);
+    if (list != stdin) {
+        fclose(list);
+    }
+}
+
+/* --stats: data-path system calls issued and page faults taken, one key=value line on stderr
+*/
+static void print_stats(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "stats: read=%lu write=%lu vmsplice=%lu mmap=%lu munmap=%lu minflt=%ld majflt=%ld\n",
+            io_stats.reads, io_stats.writes, io_stats.vmsplices, io_stats.mmaps, io_stats.munmaps,
+            usage.ru_minflt, usage.ru_majflt);
+}
+
+
+/* Block-streaming decoder: one read() and one write() per 64 KiB block. dg (if any) checksums the decoded
+   bytes while they are in cache, so a transfer can be checked against the encoder's --crc32c/--xxhash.
+*/
+static void decode_stream(int in_fd, int out_fd, struct digest *dg) {
+    char *in_buf = malloc(B64_BLOCK_SIZE);
+    uint8_t *out_buf = malloc(b64_decode_bound(B64_BLOCK_SIZE));
+    if (!in_buf || !out_buf) {
+        err(1, "Memory allocation failed");
+    }
+
+    struct b64_decoder dec;
+    b64_decoder_init(&dec, &format);
+    size_t n_out;
+    for (;;) {
+        size_t n_read = read_full(in_fd, in_buf, B64_BLOCK_SIZE);
+        if (n_read == 0) break;
+
+        if (!b64_decoder_update(&dec, in_buf, n_read, out_buf, &n_out)) {
+            errx(1, "%s at offset %llu", dec.error, (unsigned long long)dec.error_offset);
+        }
+        digest_update(dg, out_buf, n_out);
+        write_full(out_fd, out_buf, n_out);
+
+        if (n_read < B64_BLOCK_SIZE) break;
+    }
+    if (!b64_decoder_final(&dec, out_buf, &n_out)) {
+        errx(1, "%s at offset %llu", dec.error, (unsigned long long)dec.error_offset);
+    }
+    digest_update(dg, out_buf, n_out);
+    write_full(out_fd, out_buf, n_out);
+
+    free(in_buf);
+    free(out_buf);
+}
+
+// int argc - represents the number of items entered on the command line.
 //            EX: given './program input.txt' argc would be: 2
-// char *argv[] - array of pointers to arguments passed to the program. Each element of the array points to a null-terminated 
+// char *argv[] - array of pointers to arguments passed to the program. Each element of the array points to a null-terminated
 //                string that represents one argument.
 //                EX: given './program input.txt' argv would be:
 //                      argv[0] would be "./program"
 //                      argv[1] would be "input.txt"
 int main(int argc, char *argv[]) {
-    FILE *input;
+    static struct option const long_options[] = {
+        {"decode", no_argument, NULL, 'd'},                 /* -d, --decode: Base64 -> binary */
+        {"jobs", required_argument, NULL, 'j'},             /* -j N, --jobs=N: encode a regular file on N threads, or a batch on N workers */
+        {"files-from", required_argument, NULL, 'F'},       /* --files-from=LIST: also encode the NUL-separated paths in LIST */
+        {"to-files", no_argument, NULL, 'T'},               /* --to-files: encode each input into <path>.b64 */
+        {"crc32c", no_argument, NULL, 'C'},                 /* --crc32c: CRC32C of each input, computed while encoding */
+        {"xxhash", no_argument, NULL, 'X'},                 /* --xxhash: XXH64 of each input, computed while encoding */
+        {"trailer", no_argument, NULL, 'L'},                /* --trailer: checksum lines after the output instead of on stderr */
+        {"stats", no_argument, NULL, 'S'},                  /* --stats: report system calls and page faults on stderr */
+        {"url", no_argument, NULL, 'U'},                    /* --url: RFC 4648 URL-safe alphabet ("-_") */
+        {"no-pad", no_argument, NULL, 'P'},                 /* --no-pad: omit (and do not require) '=' padding */
+        {"wrap", required_argument, NULL, 'w'},             /* -w COLS, --wrap=COLS: line width, 0 = no wrapping */
+        {"raw", no_argument, NULL, 'R'},                    /* --raw: no line breaks at all, not even a final newline */
+        {NULL, 0, NULL, 0}
+    };
 
-    if (argc > 2) { 
-        // Invalid: too many arguments
-        errno = EINVAL;                                     /* "Invalid Argument" */ 
-        err(1, "Too many arguments"); 
-    } else if (argc == 2 && strcmp(argv[1], "-")) { 
-        // 2 arguments (path, file): open file
-        input = fopen(argv[1], "r");                        /* "r" = Open text file for reading */ 
-        if (!input) {
-            err(1, "Failed to open file: %s", argv[1]);
-        }
-    } else { 
-        // 1 argument: use standard input (default: keyboard)
-        input = stdin;
-    } 
-    
-    size_t char_count = 0;                                  /* For wrapping encoded lines every 76 characters */
-    size_t total_bytes_read = 0;
-    bool need_newline = false;
-
-    for (;;) {
-        uint8_t input_bytes[3] = {0};                       /* 3 bytes or 24 bits is least common multiple of 8-bit ASCII input character and 6-bit Base64 output character */ 
-        size_t n_read = fread(input_bytes, 1, 3, input);    /* # of bytes read = n_read = fread(destination for read data, read byte-by-byte, read 3 bytes, data to read) */ 
-        total_bytes_read += n_read;
-
-        if (n_read != 0) {
-            // Convert 3 bytes (24 bits) of ASCII input data into 4 characters of Base64 output
-            int alph_ind[4];                                
-            alph_ind[0] = input_bytes[0] >> 2;                                  /* Right shift two bits/discard last two bits. Ex: ABCDEFGH -> 00ABCEDF */ 
-            alph_ind[1] = (input_bytes[0] << 4 | input_bytes[1] >> 4) & 0x3Fu;  /* Last two bits of first byte + first 4 bits of second byte */
-            alph_ind[2] = (input_bytes[1] << 2 | input_bytes[2] >> 6) & 0x3Fu;  /* Last four bits of second byte + first 2 bits of third byte */
-            alph_ind[3] = input_bytes[2] & 0x3Fu;                               /* Last six bits of third byte */
-
-            char output[5];                                                     /* 4 Base64 characters + null terminator */
-            int output_length = 0;
-            for (size_t i = 0; i < 4; i++) {
-                output[i] = (i <= n_read) ? b64_alphabet[alph_ind[i]] : '=';
-                output_length++;
+    bool decode = false;
+    bool stats = false;
+    bool url = false;
+    bool pad = true;
+    bool raw = false;
+    size_t line_chars = B64_LINE_CHARS;
+    int n_threads = 1;
+    bool to_files = false;
+    char **paths = NULL;                                    /* Inputs from --files-from, then from the command line */
+    size_t n_paths = 0, paths_cap = 0;
+    bool batch = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "dj:w:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            decode = true;
+            break;
+        case 'j':
+            n_threads = atoi(optarg);
+            if (n_threads < 1) {
+                errx(1, "Invalid thread count: %s", optarg);
             }
-            output[4] = '\0';                                                   /* Null-terminate the string */ 
-
-            // Write to standard output
-            size_t n_write = fwrite(output, 1, output_length, stdout);          /* # of bytes written = n_write = fwrite(array of Base64-encoded char, write 1 char/byte, write all all output, display in terminal) */ 
-            char_count += n_write;
-
-            if (char_count >= 76) {                                             /* Wrap output to 76 characters */
-                putchar('\n');
-                char_count = 0;
-                need_newline = false;                                           // Set to false when we manually print a newline.
-            } else if (char_count > 0) {
-                need_newline = true;                                            // If any characters were printed since the last newline, set to true.
-            }
-
-            if (ferror(stdout)) {
-                err(1, "Write error");                                          /* Write error */
+            break;
+        case 'S':
+            stats = true;
+            break;
+        case 'U':
+            url = true;
+            break;
+        case 'P':
+            pad = false;
+            break;
+        case 'w': {
+            char *end;
+            unsigned long cols = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || cols > B64_MAX_WRAP) {
+                errx(1, "Invalid wrap width: %s", optarg);
             }
+            line_chars = cols;
+            break;
         }
+        case 'R':
+            raw = true;
+            break;
+        case 'F':
+            read_path_list(optarg, &paths, &n_paths, &paths_cap);
+            batch = true;
+            break;
+        case 'T':
+            to_files = true;
+            batch = true;
+            break;
+        case 'C':
+            digests.crc32c = true;
+            break;
+        case 'X':
+            digests.xxhash = true;
+            break;
+        case 'L':
+            digests.trailer = true;
+            break;
+        default:
+            errx(1, "Usage: %s [-d] [-j N] [-w COLS] [--url] [--no-pad] [--raw] [--stats] [--crc32c] [--xxhash] [--trailer] [--to-files] [--files-from=LIST] [FILE...]", argv[0]);
+        }
+    }
+
+    format.url = url;
+    format.pad = pad;
+    format.line_chars = raw ? 0 : line_chars;
+    format.final_newline = !raw;
+    signal(SIGBUS, input_shrank);
 
-        // If less than three bytes were read:
-        if (n_read < 3) {
-            if (feof(input)) {                                  /* End of file */
-                if (need_newline && total_bytes_read > 0) {
-                    putchar('\n');
+    // Several inputs: one process encodes them all, reusing its buffers from file to file
+    if (argc - optind > 1) {
+        batch = true;
+    }
+    if (batch) {
+        if (decode) {
+            errx(1, "Decoding takes a single input");
+        }
+        for (int i = optind; i < argc; i++) {
+            if (n_paths == paths_cap) {
+                paths_cap = paths_cap ? paths_cap * 2 : 64;
+                if (!(paths = realloc(paths, paths_cap * sizeof(*paths)))) {
+                    err(1, "Memory allocation failed");
                 }
-                break;                                  
             }
-            if (ferror(input)) {                
-                err(1, "Read error");                           /* Read error */
+            paths[n_paths++] = argv[i];
+        }
+        int status = encode_batch(paths, n_paths, to_files, n_threads);
+        if (stats) {
+            print_stats();
+        }
+        return status;                                      /* Paths stay allocated until exit */
+    }
+
+    int input = STDIN_FILENO;
+
+    if (argc - optind == 1 && strcmp(argv[optind], "-")) {
+        // 2 arguments (path, file): open file
+        input = open(argv[optind], O_RDONLY);               /* Open file for reading */
+        if (input < 0) {
+            err(1, "Failed to open file: %s", argv[optind]);
+        }
+    }
+    // Otherwise 1 argument: use standard input (default: keyboard)
+
+    struct digest digest, *dg = digests.crc32c || digests.xxhash ? &digest : NULL;
+    if (dg) {
+        digest_init(dg);
+    }
+    char const *name = input == STDIN_FILENO ? "-" : argv[optind];
+    if (decode) {
+        decode_stream(input, STDOUT_FILENO, dg);
+        if (dg) {
+            digests.trailer = false;                        /* Never mixed into binary output */
+            report_digest(dg, name, NULL);
+        }
+    } else {
+        size_t cap = b64_encode_bound(&format, B64_MAP_SIZE) + B64_FINAL_MAX;
+        struct sink sink = {.fd = STDOUT_FILENO, .buf = alloc_aligned(cap), .cap = cap};
+        uint8_t *in_buf = alloc_aligned(B64_BLOCK_SIZE);
+        uint64_t n_in = encode_fd(input, in_buf, &sink, n_threads, dg);
+        if (dg) {
+            if (digests.trailer) {
+                end_line(&sink, n_in);
             }
+            report_digest(dg, name, &sink);
         }
+        sink_flush(&sink);
+        free(sink.buf);
+        free(in_buf);
     }
 
     // If input was file, close open file
-    if (input != stdin) {
-        fclose(input);
+    if (input != STDIN_FILENO) {
+        close(input);
+    }
+
+    if (stats) {
+        print_stats();
     }
 
     return 0;
-} 
\ No newline at end of file
+}
@@ -0,0 +1,196 @@
+/* CRC32C and XXH64 for --crc32c and --xxhash. See checksum.h.
+*/
+
+#include <stdint.h>     // Extra fixed-width data types
+#include <string.h>     // memcpy()
+#include <stdbool.h>    // Boolean type and values
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // SSE4.2 crc32 intrinsics
+#define CRC_X86 1
+#endif
+
+#include "checksum.h"
+
+#define CRC32C_POLY 0x82F63B78u                             /* Castagnoli polynomial, bit-reversed */
+
+static uint32_t crc32c_table[256];                          /* Byte-at-a-time table for CPUs without SSE4.2 */
+static bool crc32c_hw;                                      /* SSE4.2 crc32 instruction available */
+
+/* Load-time setup: the software table and runtime CPU dispatch
+*/
+__attribute__((constructor))
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? c >> 1 ^ CRC32C_POLY : c >> 1;
+        }
+        crc32c_table[i] = c;
+    }
+#ifdef CRC_X86
+    __builtin_cpu_init();
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t c, uint8_t const *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        c = crc32c_table[(c ^ p[i]) & 0xFF] ^ c >> 8;
+    }
+    return c;
+}
+
+#ifdef CRC_X86
+/* 8 bytes per crc32 instruction; the unaligned head and the tail go a byte at a time
+*/
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw_update(uint32_t c, uint8_t const *p, size_t len) {
+    for (; len > 0 && ((uintptr_t)p & 7); len--) {
+        c = _mm_crc32_u8(c, *p++);
+    }
+#ifdef __x86_64__
+    uint64_t c64 = c;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        c64 = _mm_crc32_u64(c64, word);
+    }
+    c = c64;
+#endif
+    for (; len > 0; len--) {
+        c = _mm_crc32_u8(c, *p++);
+    }
+    return c;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, void const *buf, size_t len) {
+    uint32_t c = ~crc;
+#ifdef CRC_X86
+    if (crc32c_hw) {
+        return ~crc32c_hw_update(c, buf, len);
+    }
+#endif
+    return ~crc32c_sw(c, buf, len);
+}
+
+// XXH64 primes
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return x << r | x >> (64 - r);
+}
+
+static uint64_t read64(uint8_t const *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);                                       /* XXH64 is defined on little-endian words */
+    return v;
+}
+
+static uint32_t read32(uint8_t const *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    return rotl64(acc, 31) * XXH_P1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t v) {
+    acc ^= xxh64_round(0, v);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+void xxh64_init(struct xxh64_state *state, uint64_t seed) {
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->v[0] = seed + XXH_P1 + XXH_P2;
+    state->v[1] = seed + XXH_P2;
+    state->v[2] = seed;
+    state->v[3] = seed - XXH_P1;
+}
+
+/* Consume whole 32-byte stripes from p; returns the number of bytes consumed
+*/
+static size_t xxh64_stripes(struct xxh64_state *state, uint8_t const *p, size_t len) {
+    uint64_t v0 = state->v[0], v1 = state->v[1], v2 = state->v[2], v3 = state->v[3];
+    size_t done = 0;
+    for (; len - done >= 32; done += 32) {
+        v0 = xxh64_round(v0, read64(p + done));
+        v1 = xxh64_round(v1, read64(p + done + 8));
+        v2 = xxh64_round(v2, read64(p + done + 16));
+        v3 = xxh64_round(v3, read64(p + done + 24));
+    }
+    state->v[0] = v0;
+    state->v[1] = v1;
+    state->v[2] = v2;
+    state->v[3] = v3;
+    return done;
+}
+
+void xxh64_update(struct xxh64_state *state, void const *buf, size_t len) {
+    uint8_t const *p = buf;
+    state->total_len += len;
+
+    // Complete the stripe left over from the previous call
+    if (state->n_mem > 0) {
+        size_t take = 32 - state->n_mem < len ? 32 - state->n_mem : len;
+        memcpy(state->mem + state->n_mem, p, take);
+        state->n_mem += take;
+        p += take;
+        len -= take;
+        if (state->n_mem < 32) return;
+        xxh64_stripes(state, state->mem, 32);
+        state->n_mem = 0;
+    }
+
+    size_t done = xxh64_stripes(state, p, len);
+    memcpy(state->mem, p + done, len - done);
+    state->n_mem = len - done;
+}
+
+uint64_t xxh64_digest(struct xxh64_state const *state) {
+    uint64_t h;
+    if (state->total_len >= 32) {
+        h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) + rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = xxh64_merge(h, state->v[i]);
+        }
+    } else {
+        h = state->seed + XXH_P5;
+    }
+    h += state->total_len;
+
+    // Remaining 0-31 bytes
+    uint8_t const *p = state->mem;
+    size_t len = state->n_mem;
+    for (; len >= 8; len -= 8, p += 8) {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (len >= 4) {
+        h ^= (uint64_t)read32(p) * XXH_P1;
+        h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; len--, p++) {
+        h ^= *p * XXH_P5;
+        h = rotl64(h, 11) * XXH_P1;
+    }
+
+    // Avalanche
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
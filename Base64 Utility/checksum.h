@@ -0,0 +1,29 @@
+/* Checksums the base64 utility can compute over its input in the same pass as the encoding:
+ * CRC32C (Castagnoli, as in iSCSI and ext4) and XXH64.
+ */
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC32C of len more bytes, continuing from crc (0 to start), zlib style: crc32c(crc32c(0, a), b) is the
+ * CRC of a followed by b. Uses the SSE4.2 crc32 instruction when the CPU has it.
+ */
+extern uint32_t crc32c(uint32_t crc, void const *buf, size_t len);
+
+/* Streaming XXH64 */
+struct
+xxh64_state {
+  uint64_t total_len;
+  uint64_t v[4];              /* Accumulators for the four 8-byte lanes of each 32-byte stripe */
+  uint8_t mem[32];            /* Bytes waiting for a complete stripe */
+  size_t n_mem;
+  uint64_t seed;
+};
+
+extern void xxh64_init(struct xxh64_state *state, uint64_t seed);
+extern void xxh64_update(struct xxh64_state *state, void const *buf, size_t len);
+extern uint64_t xxh64_digest(struct xxh64_state const *state);
+
+#endif
@@ -0,0 +1,740 @@
+/* libb64: the Base64 encoder and decoder behind the base64 utility, usable on its own. Everything works on
+   caller-provided state and buffers; the only memory touched is the caller's, plus two reverse tables
+   filled in when the library is loaded. See libb64.h for the interface.
+*/
+
+#include <stdlib.h>     // NULL
+#include <stdint.h>     // Extra fixed-width data types
+#include <string.h>     // memcpy(), memset(), strcmp()
+#include <stdbool.h>    // Boolean type and values
+#include <pthread.h>    // Worker threads for b64_encode_buf_parallel()
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // SSE4.1/AVX2 intrinsics
+#define B64_X86 1
+#endif
+
+#include "libb64.h"
+
+#define B64_MAX_THREADS 64                                  /* b64_encode_buf_parallel() keeps its threads on the stack */
+
+// Entries of the reverse tables that are not 6-bit values
+#define B64_SKIP    0x80                                    /* Line break: ignored while decoding */
+#define B64_PAD     0x81                                    /* '=' */
+#define B64_INVALID 0xFF
+
+static char const b64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                   "abcdefghijklmnopqrstuvwxyz"
+                                   "0123456789"
+                                   "+/";
+
+static char const b64url_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"   /* RFC 4648 section 5: URL and filename safe */
+                                      "abcdefghijklmnopqrstuvwxyz"
+                                      "0123456789"
+                                      "-_";
+
+static uint8_t b64_reverse[256];                            /* Character -> 6-bit value, B64_SKIP, B64_PAD or B64_INVALID */
+static uint8_t b64url_reverse[256];
+
+/* Encode n_groups complete 3-byte groups into 4 * n_groups Base64 characters (no padding, no line breaks).
+   Always inlined with a constant alphabet, so each alphabet gets its own specialized copy of the loop.
+*/
+static inline __attribute__((always_inline))
+void encode_groups_generic(uint8_t const *in, size_t n_groups, char *out, char const *alphabet) {
+    for (size_t g = 0; g < n_groups; g++, in += 3, out += 4) {
+        out[0] = alphabet[in[0] >> 2];                                      /* Right shift two bits/discard last two bits. Ex: ABCDEFGH -> 00ABCEDF */
+        out[1] = alphabet[(in[0] << 4 | in[1] >> 4) & 0x3Fu];               /* Last two bits of first byte + first 4 bits of second byte */
+        out[2] = alphabet[(in[1] << 2 | in[2] >> 6) & 0x3Fu];               /* Last four bits of second byte + first 2 bits of third byte */
+        out[3] = alphabet[in[2] & 0x3Fu];                                   /* Last six bits of third byte */
+    }
+}
+
+static void encode_groups_scalar(uint8_t const *in, size_t n_groups, char *out) {
+    encode_groups_generic(in, n_groups, out, b64_alphabet);
+}
+
+static void encode_groups_scalar_url(uint8_t const *in, size_t n_groups, char *out) {
+    encode_groups_generic(in, n_groups, out, b64url_alphabet);
+}
+
+#ifdef B64_X86
+/* SSE4.1 kernel: 12 input bytes -> 16 Base64 characters per iteration.
+   pshufb copies each 3-byte group into a 32-bit lane as bytes [1,0,2,1], so the four 6-bit fields sit at
+   fixed bit positions; two 16-bit multiplies shift them into the low 6 bits of their own byte.
+*/
+__attribute__((target("sse4.1")))
+static __m128i enc_to_indices_sse(__m128i in) {
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));           /* Fields 0 and 2 */
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));           /* Fields 1 and 3 */
+    return _mm_or_si128(t1, t3);
+}
+
+/* Vector replacement for the alphabet lookup: map each 6-bit index to a small class number and add the
+   class's offset from a 16-entry table ('A'..'Z', 'a'..'z', '0'..'9', and the two alphabet-specific
+   characters for 62 and 63).
+*/
+__attribute__((target("sse4.1"), always_inline))
+static inline __m128i enc_to_ascii_sse(__m128i indices, char const *alphabet) {
+    __m128i const offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                          alphabet[62] - 62, alphabet[63] - 63, 'A', 0, 0);
+    __m128i classes = _mm_subs_epu8(indices, _mm_set1_epi8(51));           /* 26..51 -> 0, 52..63 -> 1..12 */
+    __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);             /* 0..25 -> 13 */
+    classes = _mm_or_si128(classes, _mm_and_si128(upper, _mm_set1_epi8(13)));
+    return _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, classes));
+}
+
+__attribute__((target("sse4.1"), always_inline))
+static inline void encode_sse41_generic(uint8_t const *in, size_t n_groups, char *out, char const *alphabet) {
+    // Each load reads 16 bytes but consumes 12, so stop while 6 groups (18 bytes) remain
+    for (; n_groups >= 6; n_groups -= 4, in += 12, out += 16) {
+        __m128i indices = enc_to_indices_sse(_mm_loadu_si128((__m128i const *)in));
+        _mm_storeu_si128((__m128i *)out, enc_to_ascii_sse(indices, alphabet));
+    }
+    encode_groups_generic(in, n_groups, out, alphabet);
+}
+
+__attribute__((target("sse4.1")))
+static void encode_groups_sse41(uint8_t const *in, size_t n_groups, char *out) {
+    encode_sse41_generic(in, n_groups, out, b64_alphabet);
+}
+
+__attribute__((target("sse4.1")))
+static void encode_groups_sse41_url(uint8_t const *in, size_t n_groups, char *out) {
+    encode_sse41_generic(in, n_groups, out, b64url_alphabet);
+}
+
+/* AVX2 kernel: 24 input bytes -> 32 Base64 characters per iteration, same arithmetic as the SSE4.1 kernel
+   with one 12-byte half in each 128-bit lane.
+*/
+__attribute__((target("avx2"), always_inline))
+static inline void encode_avx2_generic(uint8_t const *in, size_t n_groups, char *out, char const *alphabet) {
+    __m256i const shuffle = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                            10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    __m256i const offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                             alphabet[62] - 62, alphabet[63] - 63, 'A', 0, 0,
+                                             'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                             alphabet[62] - 62, alphabet[63] - 63, 'A', 0, 0);
+
+    // The upper lane loads 16 bytes from in + 12, so stop while 10 groups (30 bytes) remain
+    for (; n_groups >= 10; n_groups -= 8, in += 24, out += 32) {
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i const *)in)),
+                                            _mm_loadu_si128((__m128i const *)(in + 12)), 1);
+        v = _mm256_shuffle_epi8(v, shuffle);
+        __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+        __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+        __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        __m256i indices = _mm256_or_si256(t1, t3);
+
+        __m256i classes = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        classes = _mm256_or_si256(classes, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+        _mm256_storeu_si256((__m256i *)out, _mm256_add_epi8(indices, _mm256_shuffle_epi8(offsets, classes)));
+    }
+    encode_sse41_generic(in, n_groups, out, alphabet);
+}
+
+__attribute__((target("avx2")))
+static void encode_groups_avx2(uint8_t const *in, size_t n_groups, char *out) {
+    encode_avx2_generic(in, n_groups, out, b64_alphabet);
+}
+
+__attribute__((target("avx2")))
+static void encode_groups_avx2_url(uint8_t const *in, size_t n_groups, char *out) {
+    encode_avx2_generic(in, n_groups, out, b64url_alphabet);
+}
+
+/* SSE4.1 decoder: 16 characters -> 12 bytes. Returns a bitmask of the characters that are not in the
+   alphabet (line breaks and '=' included); the output is only valid when the mask is 0. Writes 16 bytes.
+   Validation and translation share one pair of nibble lookups: a character is valid when the flags looked up
+   by its low nibble and by its high nibble have no bit in common. The URL variant first turns '-' and '_'
+   into '+' and '/', and '+' and '/' into NUL so they fail validation.
+*/
+__attribute__((target("sse4.1"), always_inline))
+static inline uint32_t decode_sse41_generic(char const *in, uint8_t *out, bool url) {
+    __m128i const lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    __m128i const lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                         0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    __m128i const lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i const mask_2f = _mm_set1_epi8(0x2f);
+
+    __m128i str = _mm_loadu_si128((__m128i const *)in);
+    if (url) {
+        __m128i std_only = _mm_or_si128(_mm_cmpeq_epi8(str, _mm_set1_epi8('+')), _mm_cmpeq_epi8(str, _mm_set1_epi8('/')));
+        __m128i minus = _mm_cmpeq_epi8(str, _mm_set1_epi8('-'));
+        __m128i underscore = _mm_cmpeq_epi8(str, _mm_set1_epi8('_'));
+        str = _mm_andnot_si128(std_only, str);
+        str = _mm_blendv_epi8(str, _mm_set1_epi8('+'), minus);
+        str = _mm_blendv_epi8(str, _mm_set1_epi8('/'), underscore);
+    }
+    __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+    __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+    __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+    uint32_t bad = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) & 0xFFFFu;
+    if (bad) return bad;
+
+    // '/' shares its high nibble with '+', so it gets its own roll entry
+    __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+    __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+    str = _mm_add_epi8(str, roll);                                          /* ASCII -> 6-bit values */
+
+    // Pack four 6-bit values into 3 bytes per 32-bit lane, then squeeze out the empty 4th bytes
+    __m128i merged = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+    merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    merged = _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    _mm_storeu_si128((__m128i *)out, merged);
+    return 0;
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t decode_chunk_sse41(char const *in, uint8_t *out) {
+    return decode_sse41_generic(in, out, false);
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t decode_chunk_sse41_url(char const *in, uint8_t *out) {
+    return decode_sse41_generic(in, out, true);
+}
+
+/* AVX2 decoder: 32 characters -> 24 bytes, same method as the SSE4.1 decoder. Writes 32 bytes.
+*/
+__attribute__((target("avx2"), always_inline))
+static inline uint32_t decode_avx2_generic(char const *in, uint8_t *out, bool url) {
+    __m256i const lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    __m256i const lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    __m256i const lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m256i const mask_2f = _mm256_set1_epi8(0x2f);
+
+    __m256i str = _mm256_loadu_si256((__m256i const *)in);
+    if (url) {
+        __m256i std_only = _mm256_or_si256(_mm256_cmpeq_epi8(str, _mm256_set1_epi8('+')), _mm256_cmpeq_epi8(str, _mm256_set1_epi8('/')));
+        __m256i minus = _mm256_cmpeq_epi8(str, _mm256_set1_epi8('-'));
+        __m256i underscore = _mm256_cmpeq_epi8(str, _mm256_set1_epi8('_'));
+        str = _mm256_andnot_si256(std_only, str);
+        str = _mm256_blendv_epi8(str, _mm256_set1_epi8('+'), minus);
+        str = _mm256_blendv_epi8(str, _mm256_set1_epi8('/'), underscore);
+    }
+    __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+    __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    uint32_t bad = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256()));
+    if (bad) return bad;
+
+    __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+    __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+    str = _mm256_add_epi8(str, roll);
+
+    __m256i merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+    merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+    merged = _mm256_shuffle_epi8(merged, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+    _mm256_storeu_si256((__m256i *)out, merged);
+    return 0;
+}
+
+__attribute__((target("avx2")))
+static uint32_t decode_chunk_avx2(char const *in, uint8_t *out) {
+    return decode_avx2_generic(in, out, false);
+}
+
+__attribute__((target("avx2")))
+static uint32_t decode_chunk_avx2_url(char const *in, uint8_t *out) {
+    return decode_avx2_generic(in, out, true);
+}
+#endif
+
+/* Encoder/decoder kernels, fastest first, each specialized for both alphabets.
+   The library starts out on the first one the CPU supports.
+*/
+static struct b64_kernel {
+    char const *name;
+    char const *cpu_feature;                                /* NULL = always available */
+    void (*encode_groups)(uint8_t const *in, size_t n_groups, char *out);
+    void (*encode_groups_url)(uint8_t const *in, size_t n_groups, char *out);
+    uint32_t (*decode_chunk)(char const *in, uint8_t *out); /* NULL = scalar decoding only */
+    uint32_t (*decode_chunk_url)(char const *in, uint8_t *out);
+    size_t decode_chars;                                    /* Characters consumed per decode_chunk() call */
+} const kernels[] = {
+#ifdef B64_X86
+    {"avx2",   "avx2",   encode_groups_avx2,   encode_groups_avx2_url,   decode_chunk_avx2,  decode_chunk_avx2_url,  32},
+    {"sse4.1", "sse4.1", encode_groups_sse41,  encode_groups_sse41_url,  decode_chunk_sse41, decode_chunk_sse41_url, 16},
+#endif
+    {"scalar", NULL,     encode_groups_scalar, encode_groups_scalar_url, NULL,               NULL,                   0},
+};
+#define N_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+char const *const b64_kernel_names[] = {
+#ifdef B64_X86
+    "avx2",
+    "sse4.1",
+#endif
+    "scalar",
+    NULL
+};
+
+static struct b64_kernel const *kernel = &kernels[N_KERNELS - 1];  /* Kernel new encoders and decoders pick up */
+
+/* Check whether the CPU running us supports a kernel (cpuid via the compiler builtin)
+*/
+static bool kernel_supported(struct b64_kernel const *k) {
+    if (!k->cpu_feature) return true;
+#ifdef B64_X86
+    __builtin_cpu_init();
+    if (!strcmp(k->cpu_feature, "avx2")) return __builtin_cpu_supports("avx2");
+    if (!strcmp(k->cpu_feature, "sse4.1")) return __builtin_cpu_supports("sse4.1");
+#endif
+    return false;
+}
+
+bool b64_use_kernel(char const *name) {
+    for (size_t i = 0; i < N_KERNELS; i++) {
+        if (!strcmp(kernels[i].name, name)) {
+            if (!kernel_supported(&kernels[i])) return false;
+            kernel = &kernels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+char const *b64_kernel(void) {
+    return kernel->name;
+}
+
+/* Fill a reverse table from an alphabet
+*/
+static void build_reverse_table(uint8_t reverse[256], char const *alphabet) {
+    memset(reverse, B64_INVALID, 256);
+    for (size_t i = 0; i < 64; i++) {
+        reverse[(uint8_t)alphabet[i]] = i;
+    }
+    reverse['\n'] = B64_SKIP;
+    reverse['\r'] = B64_SKIP;
+    reverse['='] = B64_PAD;
+}
+
+/* Load-time setup: reverse tables for both alphabets and runtime CPU dispatch to the fastest kernel
+*/
+__attribute__((constructor))
+static void b64_init(void) {
+    build_reverse_table(b64_reverse, b64_alphabet);
+    build_reverse_table(b64url_reverse, b64url_alphabet);
+    for (size_t i = 0; i < N_KERNELS; i++) {
+        if (kernel_supported(&kernels[i])) {
+            kernel = &kernels[i];
+            break;
+        }
+    }
+}
+
+/* Number of characters encoding len input bytes produces, not counting line breaks
+*/
+static uint64_t encoded_chars(struct b64_options const *opts, uint64_t len) {
+    return opts->pad ? (len + 2) / 3 * 4 : len / 3 * 4 + (len % 3 ? len % 3 + 1 : 0);
+}
+
+size_t b64_encoded_size(struct b64_options const *opts, size_t len) {
+    uint64_t chars = encoded_chars(opts, len);
+    uint64_t lines = opts->line_chars ? chars / opts->line_chars : 0;
+    bool short_last_line = opts->line_chars == 0 || chars % opts->line_chars != 0;
+    return chars + lines + (opts->final_newline && chars > 0 && short_last_line);
+}
+
+size_t b64_encode_bound(struct b64_options const *opts, size_t len) {
+    // The carried bytes can complete one more group than len alone
+    uint64_t chars = (len + 2) / 3 * 4 + 4;
+    return chars + (opts->line_chars ? chars / opts->line_chars + 1 : 0);
+}
+
+/* Copy n characters to *out, breaking the line whenever the encoder's column reaches the line width
+*/
+static void put_wrapped(struct b64_encoder *enc, char **out, char const *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        *(*out)++ = src[i];
+        if (++enc->column == enc->opts.line_chars) {
+            *(*out)++ = '\n';
+            enc->column = 0;
+        }
+    }
+}
+
+/* Run encoders, one per wrap mode, picked by b64_encoder_init() so the hot loop never tests the line width.
+   Each encodes n_groups complete groups into out starting at enc->column, breaks lines as they fill up and
+   leaves enc->column where the output stopped. Returns the number of characters written.
+*/
+
+/* Width a multiple of 4 (including the default 76): whole groups per line, one kernel call per line
+*/
+static size_t encode_run_lines(struct b64_encoder *enc, uint8_t const *in, size_t n_groups, char *out) {
+    char *start = out;
+    size_t line_chars = enc->opts.line_chars;
+    size_t line_groups = line_chars / 4;
+
+    // Finish the current line
+    if (enc->column > 0) {
+        size_t n = (line_chars - enc->column) / 4;
+        if (n > n_groups) {
+            n = n_groups;
+        }
+        enc->encode_groups(in, n, out);
+        in += n * 3;
+        out += n * 4;
+        n_groups -= n;
+        enc->column += n * 4;
+        if (enc->column < line_chars) {
+            return out - start;                             /* Ran out of input mid-line */
+        }
+        *out++ = '\n';
+        enc->column = 0;
+    }
+
+    // Full lines
+    for (; n_groups >= line_groups; n_groups -= line_groups, in += line_groups * 3) {
+        enc->encode_groups(in, line_groups, out);
+        out += line_chars;
+        *out++ = '\n';
+    }
+
+    // Start of a short last line
+    enc->encode_groups(in, n_groups, out);
+    out += n_groups * 4;
+    enc->column = n_groups * 4;
+
+    return out - start;
+}
+
+/* No wrapping (-w 0, --raw): one kernel call for the whole run. The column only records that the line
+   is not empty.
+*/
+static size_t encode_run_flat(struct b64_encoder *enc, uint8_t const *in, size_t n_groups, char *out) {
+    enc->encode_groups(in, n_groups, out);
+    if (n_groups > 0) {
+        enc->column = 1;
+    }
+    return n_groups * 4;
+}
+
+/* Width not a multiple of 4: kernel calls for the groups that fit on a line, and the one group that
+   straddles each line break goes through a 4-character bounce buffer
+*/
+static size_t encode_run_odd(struct b64_encoder *enc, uint8_t const *in, size_t n_groups, char *out) {
+    char *start = out;
+    size_t line_chars = enc->opts.line_chars;
+
+    while (n_groups > 0) {
+        size_t n = (line_chars - enc->column) / 4;
+        if (n > n_groups) {
+            n = n_groups;
+        }
+        if (n > 0) {
+            enc->encode_groups(in, n, out);
+            in += n * 3;
+            out += n * 4;
+            n_groups -= n;
+            enc->column += n * 4;
+            if (enc->column == line_chars) {
+                *out++ = '\n';
+                enc->column = 0;
+            }
+        } else {
+            char quad[4];
+            enc->encode_groups(in, 1, quad);
+            put_wrapped(enc, &out, quad, 4);
+            in += 3;
+            n_groups--;
+        }
+    }
+
+    return out - start;
+}
+
+void b64_encoder_init(struct b64_encoder *enc, struct b64_options const *opts) {
+    enc->opts = *opts;
+    enc->n_carry = 0;
+    enc->column = 0;
+    enc->encode_groups = opts->url ? kernel->encode_groups_url : kernel->encode_groups;
+    if (opts->line_chars == 0) {
+        enc->encode_run = encode_run_flat;
+    } else if (opts->line_chars % 4 == 0) {
+        enc->encode_run = encode_run_lines;
+    } else {
+        enc->encode_run = encode_run_odd;
+    }
+}
+
+size_t b64_encoder_update(struct b64_encoder *enc, void const *in_, size_t len, char *out) {
+    uint8_t const *in = in_;
+    size_t n_out = 0;
+
+    // Complete the group left over from the previous call
+    if (enc->n_carry > 0) {
+        if (enc->n_carry + len < 3) {
+            memcpy(enc->carry + enc->n_carry, in, len);
+            enc->n_carry += len;
+            return 0;
+        }
+        uint8_t group[3];
+        size_t take = 3 - enc->n_carry;
+        memcpy(group, enc->carry, enc->n_carry);
+        memcpy(group + enc->n_carry, in, take);
+        n_out = enc->encode_run(enc, group, 1, out);
+        in += take;
+        len -= take;
+        enc->n_carry = 0;
+    }
+
+    n_out += enc->encode_run(enc, in, len / 3, out + n_out);
+
+    enc->n_carry = len % 3;
+    memcpy(enc->carry, in + len / 3 * 3, enc->n_carry);
+    return n_out;
+}
+
+size_t b64_encoder_final(struct b64_encoder *enc, char *out) {
+    char *start = out;
+
+    // 1 or 2 leftover bytes: one zero-filled group, cut short or padded
+    if (enc->n_carry > 0) {
+        uint8_t last[3] = {0};
+        char quad[4];
+        memcpy(last, enc->carry, enc->n_carry);
+        enc->encode_groups(last, 1, quad);
+        size_t n = enc->n_carry + 1;
+        if (enc->opts.pad) {
+            quad[3] = '=';
+            if (enc->n_carry == 1) {
+                quad[2] = '=';
+            }
+            n = 4;
+        }
+        if (enc->opts.line_chars > 0) {
+            put_wrapped(enc, &out, quad, n);
+        } else {
+            memcpy(out, quad, n);
+            out += n;
+            enc->column = 1;
+        }
+        enc->n_carry = 0;
+    }
+
+    if (enc->opts.final_newline && enc->column > 0) {
+        *out++ = '\n';
+    }
+    enc->column = 0;
+
+    return out - start;
+}
+
+size_t b64_encode_buf(struct b64_options const *opts, void const *in, size_t len, char *out) {
+    struct b64_encoder enc;
+    b64_encoder_init(&enc, opts);
+    size_t n_out = b64_encoder_update(&enc, in, len, out);
+    return n_out + b64_encoder_final(&enc, out + n_out);
+}
+
+/* One b64_encode_buf_parallel() worker's share of the input: whole wrap units, except that the last
+   share also takes the short final unit and writes the end of the output
+*/
+struct encode_job {
+    struct b64_options const *opts;
+    uint8_t const *in;
+    size_t len;
+    char *out;
+    bool last;
+};
+
+static void *encode_job_run(void *arg) {
+    struct encode_job *job = arg;
+    struct b64_encoder enc;
+    b64_encoder_init(&enc, job->opts);
+    size_t n_out = b64_encoder_update(&enc, job->in, job->len, job->out);
+    if (job->last) {
+        b64_encoder_final(&enc, job->out + n_out);
+    }
+    return NULL;
+}
+
+size_t b64_encode_buf_parallel(struct b64_options const *opts, void const *in_, size_t len, char *out,
+                               int n_threads) {
+    uint8_t const *in = in_;
+
+    // A unit of lcm(line_chars, 4) characters ends on both a line and a group boundary, so every share
+    // but the last starts at column 0 and its output offset is known up front
+    size_t unit_bytes = 3, unit_chars = 4;
+    if (opts->line_chars > 0) {
+        size_t line_chars = opts->line_chars;
+        size_t unit = line_chars % 4 == 0 ? line_chars : line_chars % 2 == 0 ? line_chars * 2 : line_chars * 4;
+        unit_bytes = unit / 4 * 3;
+        unit_chars = unit + unit / line_chars;
+    }
+
+    size_t units = (len + unit_bytes - 1) / unit_bytes;     /* Counting the short final unit */
+    if (n_threads > B64_MAX_THREADS) {
+        n_threads = B64_MAX_THREADS;
+    }
+    if ((size_t)n_threads > units) {
+        n_threads = units;
+    }
+    if (n_threads <= 1) {
+        return b64_encode_buf(opts, in, len, out);
+    }
+
+    pthread_t threads[B64_MAX_THREADS];
+    struct encode_job jobs[B64_MAX_THREADS];
+    bool running[B64_MAX_THREADS];
+    for (int t = 0; t < n_threads; t++) {
+        size_t first = units * t / n_threads;
+        size_t end = units * (t + 1) / n_threads;
+        size_t in_off = first * unit_bytes;
+        size_t in_end = end * unit_bytes < len ? end * unit_bytes : len;
+
+        jobs[t] = (struct encode_job){opts, in + in_off, in_end - in_off, out + first * unit_chars, t == n_threads - 1};
+        running[t] = pthread_create(&threads[t], NULL, encode_job_run, &jobs[t]) == 0;
+        if (!running[t]) {
+            encode_job_run(&jobs[t]);                       /* Out of threads: do this share here */
+        }
+    }
+    for (int t = 0; t < n_threads; t++) {
+        if (running[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+
+    return b64_encoded_size(opts, len);
+}
+
+void b64_decoder_init(struct b64_decoder *dec, struct b64_options const *opts) {
+    memset(dec, 0, sizeof(*dec));
+    dec->opts = *opts;
+    dec->reverse = opts->url ? b64url_reverse : b64_reverse;
+    dec->decode_chunk = opts->url ? kernel->decode_chunk_url : kernel->decode_chunk;
+    dec->decode_chars = kernel->decode_chars;
+}
+
+size_t b64_decode_bound(size_t len) {
+    return len / 4 * 3 + 3 + B64_DECODE_SLACK;
+}
+
+static bool decode_fail(struct b64_decoder *dec, char const *message, uint64_t offset) {
+    dec->error = message;
+    dec->error_offset = offset;
+    return false;
+}
+
+/* Scalar decoder: one reverse table lookup per character. Advances *out past the decoded bytes.
+*/
+static bool decode_scalar(struct b64_decoder *dec, char const *in, size_t len, uint8_t **out) {
+    uint8_t const *reverse = dec->reverse;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t value = reverse[(uint8_t)in[i]];
+        if (value == B64_SKIP) continue;
+        if (value == B64_INVALID) return decode_fail(dec, "Invalid character", dec->offset + i);
+        if (dec->done) return decode_fail(dec, "Data after padding", dec->offset + i);
+
+        if (value == B64_PAD) {
+            if (dec->n_quad < 2) return decode_fail(dec, "Unexpected padding", dec->offset + i);
+            dec->n_pad++;
+            value = 0;
+        } else if (dec->n_pad > 0) {
+            return decode_fail(dec, "Data after padding", dec->offset + i);
+        }
+        dec->quad[dec->n_quad++] = value;
+
+        if (dec->n_quad == 4) {
+            // Reassemble 4 * 6 bits into 3 bytes; each '=' drops one byte from the end
+            uint32_t bits = dec->quad[0] << 18 | dec->quad[1] << 12 | dec->quad[2] << 6 | dec->quad[3];
+            (*out)[0] = bits >> 16;
+            (*out)[1] = bits >> 8;
+            (*out)[2] = bits;
+            *out += 3 - dec->n_pad;
+            dec->done = dec->n_pad > 0;
+            dec->n_quad = 0;
+            dec->n_pad = 0;
+        }
+    }
+    dec->offset += len;
+    return true;
+}
+
+/* Whenever a quantum boundary is reached the SIMD kernel tries the next 16/32 characters; if any of them
+   is not a plain alphabet character, the scalar decoder takes over up to and including the first such
+   character (usually the line break), so errors are reported at the exact offset.
+*/
+bool b64_decoder_update(struct b64_decoder *dec, char const *in, size_t len, void *out_, size_t *n_out) {
+    uint8_t *start = out_, *out = out_;
+    size_t chunk = dec->decode_chars;
+
+    for (size_t i = 0; i < len; ) {
+        size_t stop = len;
+        if (chunk && !dec->done) {
+            if (dec->n_quad == 0 && len - i >= chunk) {
+                uint32_t bad = dec->decode_chunk(in + i, out);
+                if (!bad) {
+                    i += chunk;
+                    out += chunk / 4 * 3;
+                    dec->offset += chunk;
+                    continue;
+                }
+                stop = i + __builtin_ctz(bad) + 1;
+            } else if (dec->n_quad != 0) {
+                stop = i + 1;                               /* Finish the quantum, then try the kernel again */
+            }
+        }
+        if (!decode_scalar(dec, in + i, stop - i, &out)) {
+            *n_out = out - start;
+            return false;
+        }
+        i = stop;
+    }
+
+    *n_out = out - start;
+    return true;
+}
+
+/* End of input: the data must end on a quantum boundary, except that without padding a final quantum of
+   2 or 3 characters is accepted and decoded (1 or 2 bytes)
+*/
+bool b64_decoder_final(struct b64_decoder *dec, void *out_, size_t *n_out) {
+    uint8_t *out = out_;
+    *n_out = 0;
+    if (dec->n_quad == 0) return true;
+    if (dec->opts.pad || dec->n_quad == 1) {
+        return decode_fail(dec, "Truncated input", dec->offset);
+    }
+
+    uint32_t bits = dec->quad[0] << 18 | dec->quad[1] << 12 | (dec->n_quad == 3 ? dec->quad[2] << 6 : 0);
+    out[0] = bits >> 16;
+    out[1] = bits >> 8;
+    *n_out = dec->n_quad - 1;
+    dec->n_quad = 0;
+    return true;
+}
+
+bool b64_decode_buf(struct b64_decoder *dec, struct b64_options const *opts, char const *in, size_t len,
+                    void *out, size_t *n_out) {
+    size_t n_final;
+    b64_decoder_init(dec, opts);
+    if (!b64_decoder_update(dec, in, len, out, n_out)
+            || !b64_decoder_final(dec, (uint8_t *)out + *n_out, &n_final)) {
+        return false;
+    }
+    *n_out += n_final;
+    return true;
+}
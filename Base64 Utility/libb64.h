@@ -0,0 +1,95 @@
+/* This header file provides the public declarations of libb64, the Base64 encoder and decoder behind
+ * the base64 utility, so that other programs can use it.
+ *
+ * The library never allocates: all state lives in caller-provided structs and all output goes to
+ * caller-provided buffers sized with the bound and size helpers below. The fastest kernel the
+ * CPU supports (AVX2, SSE4.1 or scalar) is picked when the library is loaded.
+ */
+#ifndef LIBB64_H
+#define LIBB64_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* By convention, exposed library interfaces are prefixed
+ * with the name of the library, in this case "b64_"
+ */
+
+#define B64_LINE_CHARS   76   /* RFC 2045 line width */
+#define B64_DECODE_SLACK 32   /* Extra output bytes the SIMD decoders may scribble past the decoded data */
+
+struct
+b64_options {
+  bool url;                   /* RFC 4648 URL/filename-safe alphabet ("-_" instead of "+/") */
+  bool pad;                   /* Write '=' padding; when false the decoder also accepts unpadded input */
+  size_t line_chars;          /* Line width, 0 = no line breaks */
+  bool final_newline;         /* End a short last line with a newline */
+};
+
+/* Default RFC 2045 MIME output: padded, 76-column lines, final newline */
+#define B64_OPTIONS_MIME ((struct b64_options){.pad = true, .line_chars = B64_LINE_CHARS, .final_newline = true})
+
+/* Streaming encoder. Fields are private; the struct is public only so callers can own the memory. */
+struct
+b64_encoder {
+  struct b64_options opts;
+  uint8_t carry[2];           /* Input bytes waiting for a complete 3-byte group */
+  size_t n_carry;
+  size_t column;              /* Characters on the current output line */
+  void (*encode_groups)(uint8_t const *in, size_t n_groups, char *out);
+  size_t (*encode_run)(struct b64_encoder *enc, uint8_t const *in, size_t n_groups, char *out);
+};
+
+/* Streaming decoder. error and error_offset describe the first malformed character after a failed call. */
+struct
+b64_decoder {
+  struct b64_options opts;
+  uint8_t const *reverse;     /* Character -> 6-bit value table for the alphabet */
+  uint32_t (*decode_chunk)(char const *in, uint8_t *out);
+  size_t decode_chars;
+  uint8_t quad[4];            /* 6-bit values of the current 4-character quantum */
+  int n_quad;
+  int n_pad;
+  bool done;                  /* A padded quantum ended the data */
+  uint64_t offset;            /* Input offset of the next character */
+  char const *error;
+  uint64_t error_offset;
+};
+
+/* Encoding: init once, update with any amount of input, final once. update() writes at most
+ * b64_encode_bound(opts, len) characters; final() writes at most B64_FINAL_MAX.
+ */
+#define B64_FINAL_MAX 8
+extern void b64_encoder_init(struct b64_encoder *enc, struct b64_options const *opts);
+extern size_t b64_encoder_update(struct b64_encoder *enc, void const *in, size_t len, char *out);
+extern size_t b64_encoder_final(struct b64_encoder *enc, char *out);
+extern size_t b64_encode_bound(struct b64_options const *opts, size_t len);
+
+/* One-shot encoding into exactly b64_encoded_size(opts, len) characters. The parallel version splits
+ * the input on line boundaries and encodes the pieces on n_threads threads; the output is identical.
+ */
+extern size_t b64_encoded_size(struct b64_options const *opts, size_t len);
+extern size_t b64_encode_buf(struct b64_options const *opts, void const *in, size_t len, char *out);
+extern size_t b64_encode_buf_parallel(struct b64_options const *opts, void const *in, size_t len, char *out,
+                                      int n_threads);
+
+/* Decoding: line breaks are skipped, anything else outside the alphabet is an error. update() and
+ * final() return false on malformed input and set dec->error / dec->error_offset. Output buffers
+ * must hold b64_decode_bound(len) bytes.
+ */
+extern void b64_decoder_init(struct b64_decoder *dec, struct b64_options const *opts);
+extern bool b64_decoder_update(struct b64_decoder *dec, char const *in, size_t len, void *out, size_t *n_out);
+extern bool b64_decoder_final(struct b64_decoder *dec, void *out, size_t *n_out);
+extern size_t b64_decode_bound(size_t len);
+extern bool b64_decode_buf(struct b64_decoder *dec, struct b64_options const *opts, char const *in, size_t len,
+                           void *out, size_t *n_out);
+
+/* Kernel selection, for benchmarks and tests. Encoders and decoders keep the kernel that was active
+ * when they were initialized.
+ */
+extern char const *const b64_kernel_names[];                 /* Compiled-in kernels, fastest first, NULL-terminated */
+extern bool b64_use_kernel(char const *name);                 /* False if unknown or not supported by this CPU */
+extern char const *b64_kernel(void);                          /* Name of the kernel in use */
+
+#endif
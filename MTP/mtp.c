@@ -5,240 +5,1570 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+
+#ifndef MTP_QUEUE_MUTEX
+#include <stdatomic.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#else
+#include <sched.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // _mm_pause() while spinning
+#endif
+#endif
+
+#include "transform.h"
+
+#define CACHE_LINE 64
 
-#define MAX_LINE_LENGTH 1000
 #define MAX_LINES 50
-#define BUFFER_SIZE MAX_LINES
-#define POISON_PILL "POISON_PILL"
-
-// Buffers
-char buffer_1[MAX_LINES][MAX_LINE_LENGTH];
-char buffer_2[MAX_LINES][MAX_LINE_LENGTH];
-char buffer_3[MAX_LINES][MAX_LINE_LENGTH];
-
-// Number of items in each buffer   
-int count_1 = 0;  
-int count_2 = 0; 
-int count_3 = 0;       
-
-// Next producer position index in each buffer 
-int prod_idx_1 = 0;
-int prod_idx_2 = 0;
-int prod_idx_3 = 0;
-
-// Next consumer position index in each buffer                 
-int con_idx_1 = 0; 
-int con_idx_2 = 0; 
-int con_idx_3 = 0;                   
-
-// Mutexes and Condition Variables
-pthread_mutex_t mutex_buffer_1 = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t mutex_buffer_2 = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t mutex_buffer_3 = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t cond_buffer_1 = PTHREAD_COND_INITIALIZER;
-pthread_cond_t cond_buffer_2 = PTHREAD_COND_INITIALIZER;
-pthread_cond_t cond_buffer_3 = PTHREAD_COND_INITIALIZER;
+#define POISON_PILL NULL    // Passed on in place of a batch to stop the next stage
+#define MIN_READ 4096       // Smallest read() get_input makes into a batch
+#define FUSED_READ_SIZE (1 << 20)   // --fused reads standard input in blocks of this size
+#define POPULATE_BYTES (256 << 20)  // --fused faults in mapped input files up to this size up front
+#define OUTPUT_RECORDS 4096         // Output is written up to this many 81-byte records at a time
+
+// Batching defaults, see -n, -b and -t
+#define BATCH_LINES 256
+#define BATCH_BYTES 65536
+#define FLUSH_MS 10
+#define MAX_BATCH_LINES (1 << 20)
+#define MAX_BATCH_BYTES (1 << 30)
+#define POOL_BYTES (16 << 20)   // Batches in the pool are limited to about this much text in total
+
+#ifdef MTP_TRACE
+/* Instrumentation, compiled in with -DMTP_TRACE: how long each side of each buffer spent waiting, how
+ * full the buffers were, and how long lines took from get_input to write_output. It is dumped to stderr
+ * on exit and on SIGUSR1 (see trace_dump()).
+ */
+#define TRACE_BUCKETS 32            // Occupancy histogram: 0, 1, 2-3, 4-7, ...
+#define LATENCY_BUCKETS (64 * 4)    // Latency histogram: four buckets per power of two nanoseconds
+
+/* One buffer's counters. Each side has its own, on its own cache line; the dump reads them as they are.
+ */
+struct queue_trace {
+    _Alignas(CACHE_LINE) uint64_t puts;
+    uint64_t wait_full_ns;                      // Producer time waiting for room
+    uint64_t occupancy[TRACE_BUCKETS];          // Items in the buffer at each put
+    _Alignas(CACHE_LINE) uint64_t gets;
+    uint64_t wait_empty_ns;                     // Consumer time waiting for an item
+};
+
+uint64_t trace_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Counters have a single writer; relaxed atomics keep a mid-run dump from reading torn values
+#define TRACE_ADD(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define TRACE_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+#define TRACE_WAIT_BEGIN() uint64_t trace_wait_start = trace_ns()
+#define TRACE_WAIT_END(counter) TRACE_ADD(counter, trace_ns() - trace_wait_start)
+#define TRACE_PUT(buffer, items) trace_put(&(buffer)->trace, items)
+#define TRACE_GET_ITEM(buffer) TRACE_ADD((buffer)->trace.gets, 1)
+#define TRACE_FIRST_LINE(batch) ((batch)->n_lines == 1 ? (void)((batch)->first_line_ns = trace_ns()) : (void)0)
+#define TRACE_OUTPUT(batch) trace_latency(batch)
+#else
+#define TRACE_WAIT_BEGIN() (void)0
+#define TRACE_WAIT_END(counter) (void)0
+#define TRACE_PUT(buffer, items) (void)0
+#define TRACE_GET_ITEM(buffer) (void)0
+#define TRACE_FIRST_LINE(batch) (void)0
+#define TRACE_OUTPUT(batch) (void)0
+#endif
+
+/* A batch of lines in flight. get_input fills one with up to batch_lines lines or batch_bytes bytes, or
+ * with whatever arrived within flush_ms of its first line, and it moves through the stages as one unit.
+ * Nor does a finished batch wait more than flush_ms in an unflushed buffer while get_input waits for input.
+ * Batches come from a fixed pool: get_input takes one from the free list and read()s into it, each stage
+ * transforms it in place and passes the pointer on, and write_output puts it back on the free list.
+ * Whoever holds the pointer owns the batch; the buffers only ever hold pointers.
+ */
+struct batch {
+    unsigned long seq;  // Position in the input, counting batches
+    size_t n_lines;
+    size_t size;        // Bytes of text
+    size_t *ends;       // The lines are stored back to back: line i ends at text + ends[i]
+    char *text;
+    size_t capacity;    // Bytes allocated for text; grows to fit a line of any length
+#ifdef MTP_TRACE
+    uint64_t first_line_ns; // When get_input took its first line
+#endif
+};
+
+size_t batch_lines = BATCH_LINES;
+size_t batch_bytes = BATCH_BYTES;
+int flush_ms = FLUSH_MS;
+
+/* Per-stage counters for --stats, one set per thread; each thread only updates its own
+ */
+struct stage_stats {
+    const char *name;
+    unsigned long batches;
+    unsigned long lines;
+    unsigned long long bytes;   // Bytes taken in
+    double busy;                // Seconds spent on batches, not waiting on the buffers
+    unsigned long syscalls;     // read(), poll() and write() calls
+};
+
+#ifdef MTP_TRACE
+bool stats = true;          // Collect the per-stage counters: always for the trace, ...
+#else
+bool stats = false;
+#endif
+bool report_stats = false;  // ... and print them for --stats
+bool fused = false;
+struct stage_stats input_stats = {.name = "input"};
+struct stage_stats output_stats = {.name = "output"};
+struct stage_stats fused_stats = {.name = "fused"};
+
+#ifdef MTP_QUEUE_MUTEX
+/* Bounded buffer between two stages, guarded by a mutex and a condition variable (build with
+ * -DMTP_QUEUE_MUTEX)
+ */
+struct buffer {
+    struct batch **items;
+    int capacity;
+    int count;          // Number of items in the buffer
+    int prod_idx;       // Next producer position index
+    int con_idx;        // Next consumer position index
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#ifdef MTP_TRACE
+    struct queue_trace trace;
+#endif
+};
+
+#define QUEUE_CAPACITY MAX_LINES    // Default -q
+#else
+#define QUEUE_CAPACITY 64   // Default -q; ring sizes are rounded up to a power of two, so the free-running indices wrap cleanly
+#define RING_BATCH 8        // Indices are published to the other side every RING_BATCH items
+#define RING_SPIN 200       // Polls of the other side's index before sleeping on it (multi-core only)
+
+/* Lock-free single-producer/single-consumer ring between two stages (the default). Each side owns its
+ * index and only publishes it every RING_BATCH items, or before it waits, so the shared cache lines
+ * move between cores once per RING_BATCH items rather than once per item. A side that finds the ring full or
+ * empty spins briefly, then sleeps on the other side's index with a futex.
+ */
+struct buffer {
+    // Shared indices, each on its own cache line
+    _Alignas(CACHE_LINE) _Atomic uint32_t tail;     // Items published by the producer
+    _Atomic uint32_t consumer_sleeping;
+    _Alignas(CACHE_LINE) _Atomic uint32_t head;     // Slots handed back by the consumer
+    _Atomic uint32_t producer_sleeping;
+
+    // Producer side
+    _Alignas(CACHE_LINE) uint32_t prod_idx;         // Next slot to fill
+    uint32_t head_seen;                             // Last head read; only reread when the ring looks full
+
+    // Consumer side
+    _Alignas(CACHE_LINE) uint32_t con_idx;          // Next slot to read
+    uint32_t tail_seen;                             // Last tail read; only reread when the ring looks empty
+
+    // Set up before the threads start
+    _Alignas(CACHE_LINE) uint32_t slots;            // A power of two
+    uint32_t publish_every;                         // RING_BATCH, or 1 where waiting for a batch of them could stall
+    struct batch **items;
+#ifdef MTP_TRACE
+    struct queue_trace trace;
+#endif
+};
+
+int ring_spin = RING_SPIN;  // 0 on a single CPU, where the other side cannot run while we spin
+#endif
+
+#define MAX_QUEUE_CAPACITY (1 << 16)
+#define POOL_BATCHES 64     // At most this many batches in flight
+
+size_t queue_capacity = QUEUE_CAPACITY;
+
+// Batch pool. write_output is the only stage that returns batches and get_input the only one that takes
+// them, so the free list is one more buffer.
+struct batch batch_pool[POOL_BATCHES];
+struct buffer free_batches;
+
+/* A filter transforms a batch in place; the stages between get_input and write_output are made of them
+ */
+struct filter {
+    const char *name;
+    void (*apply)(struct batch *batch);
+    bool cheap;     // Cheap enough per byte that it is better run on a neighbouring stage's thread
+};
+
+/* The buffers from one stage to the next, get_input and write_output counting as stages of one thread:
+ * one for each pair of threads on either side, so that every buffer still has a single producer and a
+ * single consumer. Batch number seq is handled by thread seq % threads of each stage and goes through
+ * buffers[seq % from * to + seq % to]. Every thread takes its batches from those buffers in turn, so
+ * batches come out of a stage in input order however its threads' progress varies.
+ */
+struct edge {
+    int from, to;           // Threads on either side
+    struct buffer *buffers;
+};
+
+#define MAX_STAGES 8
+#define MAX_STAGE_FILTERS 8
+#define MAX_THREADS 64      // Per stage
+#define STAGE_NAME 64
+
+/* A stage: filters applied in turn to each batch, by one thread or by several taking turns
+ */
+struct stage {
+    char name[STAGE_NAME];              // Its filters' names joined with '+'
+    struct filter const *filters[MAX_STAGE_FILTERS];
+    int n_filters;
+    int threads;
+    bool pinned;                        // Thread count given in the spec: keep it a stage of its own
+    struct edge *in, *out;
+    struct stage_stats stats[MAX_THREADS];
+    char thread_names[MAX_THREADS][STAGE_NAME + 4];
+};
+
+// What run_stage() is started with: which stage it runs, and which of its threads it is
+struct stage_thread {
+    struct stage *stage;
+    int thread;
+};
+
+#define DEFAULT_STAGES "newline,plus"
+
+struct stage stages[MAX_STAGES];
+int n_stages = 0;
+struct edge edges[MAX_STAGES + 1];      // edges[0] leaves get_input, edges[n_stages] reaches write_output
 
 /* FORWARD DECLARATIONS: inform the compiler about the function signature before use 
  */
 void *get_input(void *args);
-void *replace_line_separator(void *args);
-void *replace_plus_sign(void *args);
+void *run_stage(void *args);
 void *write_output(void *args);
-void put_in_buffer(char buffer[MAX_LINES][MAX_LINE_LENGTH], int *prod_idx, int *count, pthread_mutex_t *mutex, pthread_cond_t *cond, const char *item);
-char *get_from_buffer(char buffer[MAX_LINES][MAX_LINE_LENGTH], int *prod_idx, int *con_idx, int *count, pthread_mutex_t *mutex, pthread_cond_t *cond);
+void replace_line_separator(struct batch *batch);
+void replace_plus_sign(struct batch *batch);
+void init_buffer(struct buffer *buffer, size_t capacity, bool eager);
+struct buffer *edge_buffer(struct edge const *e, unsigned long seq);
+void pass_poison_pill(struct edge const *e, int thread);
+void flush_edge(struct edge const *e, int thread);
+void put_in_buffer(struct buffer *buffer, struct batch *item);
+struct batch *get_from_buffer(struct buffer *buffer, struct buffer *downstream);
+void flush_buffer(struct buffer *buffer);
+bool buffer_empty(struct buffer *buffer);
+size_t buffer_capacity(struct buffer const *buffer);
+#ifdef MTP_TRACE
+void trace_put(struct queue_trace *t, size_t items);
+void trace_latency(struct batch const *batch);
+void trace_start(void);
+void trace_stop(void);
+#endif
+void print_stats(struct stage_stats const *s);
+void run_fused(void);
+void parse_stages(const char *spec);
+void run_pipeline(void);
 
-int main() {
-    srand(time(0));
-    pthread_t input_thread, line_separator_thread, plus_sign_thread, output_thread;
+/* Seconds on the monotonic clock, for --stats and the flush timeout
+*/
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    // Create threads
-    pthread_create(&input_thread, NULL, get_input, NULL);
-    pthread_create(&line_separator_thread, NULL, replace_line_separator, NULL);
-    pthread_create(&plus_sign_thread, NULL, replace_plus_sign, NULL);
-    pthread_create(&output_thread, NULL, write_output, NULL);
+int main(int argc, char *argv[]) {
+    static struct option const long_options[] = {
+        {"batch-lines", required_argument, NULL, 'n'},  // -n N: at most N lines per batch
+        {"batch-bytes", required_argument, NULL, 'b'},  // -b BYTES: close a batch once it holds BYTES bytes
+        {"flush-ms", required_argument, NULL, 't'},     // -t MS: hand lines on if no more input arrives within MS ms of their reading
+        {"stats", no_argument, NULL, 'S'},              // --stats: per-stage throughput on stderr at the end
+        {"fused", no_argument, NULL, 'F'},              // --fused: one thread, all transforms in a single pass
+        {"stages", required_argument, NULL, 's'},       // -s SPEC: the stages between input and output, see parse_stages()
+        {"workers", required_argument, NULL, 'j'},      // -j N: short for -s newline+plus*N, N threads doing both transforms
+        {"queue", required_argument, NULL, 'q'},        // -q N: room for N batches in each buffer between stages
+        {NULL, 0, NULL, 0}
+    };
 
-    // Wait for threads to finish
-    pthread_join(input_thread, NULL);
-    pthread_join(line_separator_thread, NULL);
-    pthread_join(plus_sign_thread, NULL);
-    pthread_join(output_thread, NULL);
+    const char *spec = NULL;
+    char workers_spec[32];
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:b:t:s:j:q:", long_options, NULL)) != -1) {
+        char *end;
+        long value = optarg ? strtol(optarg, &end, 10) : 0;
+        bool valid = optarg && *optarg != '\0' && *end == '\0';
+        switch (opt) {
+        case 'n':
+            if (!valid || value < 1 || value > MAX_BATCH_LINES) {
+                errx(1, "Invalid batch line count: %s", optarg);
+            }
+            batch_lines = value;
+            break;
+        case 'b':
+            if (!valid || value < 1 || value > MAX_BATCH_BYTES) {
+                errx(1, "Invalid batch size: %s", optarg);
+            }
+            batch_bytes = value;
+            break;
+        case 't':
+            if (!valid || value < 0 || value > 60000) {
+                errx(1, "Invalid flush latency: %s", optarg);
+            }
+            flush_ms = value;
+            break;
+        case 's':
+            spec = optarg;
+            break;
+        case 'j':
+            if (!valid || value < 1 || value > MAX_THREADS) {
+                errx(1, "Invalid number of workers: %s", optarg);
+            }
+            snprintf(workers_spec, sizeof(workers_spec), "newline+plus*%ld", value);
+            spec = workers_spec;
+            break;
+        case 'q':
+            if (!valid || value < 1 || value > MAX_QUEUE_CAPACITY) {
+                errx(1, "Invalid queue capacity: %s", optarg);
+            }
+            queue_capacity = value;
+            break;
+        case 'S':
+            stats = true;
+            report_stats = true;
+            break;
+        case 'F':
+            fused = true;
+            break;
+        default:
+            errx(1, "Usage: %s [-n LINES] [-b BYTES] [-t MS] [-q BATCHES] [-s STAGES | -j WORKERS | --fused] [--stats]", argv[0]);
+        }
+    }
+    if (optind < argc) {
+        errx(1, "Usage: %s [-n LINES] [-b BYTES] [-t MS] [-q BATCHES] [-s STAGES | -j WORKERS | --fused] [--stats]", argv[0]);
+    }
+
+    if (fused && spec) {
+        errx(1, "--fused runs its own stages");
+    }
+
+    srand(time(0));
+    if (fused) {
+#ifdef MTP_TRACE
+        trace_start();
+#endif
+        run_fused();
+#ifdef MTP_TRACE
+        trace_stop();
+#endif
+        if (report_stats) {
+            print_stats(&fused_stats);
+        }
+        return EXIT_SUCCESS;
+    }
+#ifndef MTP_QUEUE_MUTEX
+    if (sysconf(_SC_NPROCESSORS_ONLN) == 1) {
+        ring_spin = 0;
+    }
+#endif
+    parse_stages(spec ? spec : DEFAULT_STAGES);
+
+    // Every batch starts out free. Big batches get a smaller pool.
+    size_t n_pool = POOL_BYTES / (batch_bytes + MIN_READ);
+    if (n_pool < 2) {
+        n_pool = 2;
+    } else if (n_pool > POOL_BATCHES) {
+        n_pool = POOL_BATCHES;
+    }
+    // The free list has room for the whole pool, so that releasing a batch never waits
+    init_buffer(&free_batches, n_pool, false);
+    for (size_t i = 0; i < n_pool; i++) {
+        batch_pool[i].ends = malloc(batch_lines * sizeof(size_t));
+        batch_pool[i].capacity = batch_bytes + MIN_READ;
+        batch_pool[i].text = malloc(batch_pool[i].capacity);
+        if (!batch_pool[i].ends || !batch_pool[i].text) {
+            err(1, "Memory allocation failed");
+        }
+        put_in_buffer(&free_batches, &batch_pool[i]);
+    }
+    flush_buffer(&free_batches);
 
+#ifdef MTP_TRACE
+    trace_start();
+#endif
+    run_pipeline();
+#ifdef MTP_TRACE
+    trace_stop();
+#endif
     return EXIT_SUCCESS;
 }
 
-/* Input Thread Function: Reads in lines of characters from the standard input
+/* --stats: one key=value line per stage on stderr. Rates are over the time the stage was busy, so the
+ * stage with the lowest rate is the bottleneck. Busy time for input includes time blocked in read().
 */
-void *get_input(void *args) {
-    char line[MAX_LINE_LENGTH];
+void print_stats(struct stage_stats const *s) {
+    double busy = s->busy > 0 ? s->busy : 1e-9;
+    fprintf(stderr, "stats: stage=%s batches=%lu lines=%lu bytes=%llu syscalls=%lu busy=%.6f lines/s=%.0f MB/s=%.1f\n",
+            s->name, s->batches, s->lines, s->bytes, s->syscalls, s->busy, s->lines / busy, s->bytes / 1e6 / busy);
+}
 
-    while (fgets(line, MAX_LINE_LENGTH, stdin)) {
-        // Read a line from standard input
-        if (strncmp(line, "STOP\n", 5) == 0) {
-            put_in_buffer(buffer_1, &prod_idx_1, &count_1, &mutex_buffer_1, &cond_buffer_1, POISON_PILL);
-            break;
-        } else {
-            put_in_buffer(buffer_1, &prod_idx_1, &count_1, &mutex_buffer_1, &cond_buffer_1, line);
+/* Standard input. get_input read()s straight into the batch it is filling and cuts the lines out of it
+ * where they are; whatever it read past the last line the batch takes is kept here for the next batches.
+*/
+struct reader {
+    size_t pos;                 // Next carried-over byte
+    size_t end;                 // End of the bytes carried over
+    size_t capacity;
+    char *carry;
+    bool eof;
+    unsigned long long bytes;   // Bytes and lines read so far, for the average line length
+    unsigned long lines;
+};
+
+struct reader input;
+
+/* Make room for at least need bytes of text in a batch
+*/
+void grow_batch(struct batch *batch, size_t need) {
+    if (batch->capacity >= need) return;
+    size_t capacity = batch->capacity * 2 > need ? batch->capacity * 2 : need;
+    char *text = realloc(batch->text, capacity);
+    if (!text) {
+        err(1, "Memory allocation failed");
+    }
+    batch->text = text;
+    batch->capacity = capacity;
+}
+
+/* Read up to len bytes of standard input to dst. Returns how many, 0 at end of input.
+*/
+size_t read_input(struct reader *in, char *dst, size_t len) {
+    if (in->eof) return 0;
+    ssize_t n;
+    while (input_stats.syscalls++, (n = read(STDIN_FILENO, dst, len)) < 0) {
+        if (errno != EINTR) {
+            err(1, "Failed to read input");
         }
     }
+    in->eof = n == 0;
+    return n;
+}
 
-    return NULL;
+/* Bytes of carried-over input for the next batch: as many lines as it takes, or all of it
+*/
+size_t carried_lines(struct reader const *in) {
+    if (in->pos == in->end) return 0;
+    char const *p = in->carry + in->pos;
+    size_t n = in->end - in->pos, take = 0;
+    for (size_t lines = 0; lines < batch_lines && take < batch_bytes; lines++) {
+        char const *newline = memchr(p + take, '\n', n - take);
+        if (!newline) return n;
+        take = newline - p + 1;
+    }
+    return take;
 }
 
-/* Line Separator Thread Function: Replaces every line separator in the input by a space
+/* Whether standard input can be read without waiting past deadline
 */
-void *replace_line_separator(void *args) {
-    while (1) {
-        char *line = get_from_buffer(buffer_1, &prod_idx_1, &con_idx_1, &count_1, &mutex_buffer_1, &cond_buffer_1);
+bool input_ready(struct reader *in, double deadline) {
+    if (in->eof) return true;
+    struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+    int timeout = (deadline - now_seconds()) * 1000;
+    input_stats.syscalls++;
+    return poll(&pfd, 1, timeout > 0 ? timeout : 0) != 0;
+}
 
-        // Check for the stop-processing condition, i.e., poison pill
-        if (strcmp(line, POISON_PILL) == 0) {
-            // Put the poison pill in buffer_2 and break
-            put_in_buffer(buffer_2, &prod_idx_2, &count_2, &mutex_buffer_2, &cond_buffer_2, POISON_PILL);
-            break;
+/* How much to read into a batch holding filled bytes with room for lines more lines: about what those
+ * lines should add up to at the average line length, so that little is read past them and carried over
+*/
+size_t read_size(struct reader const *in, struct batch const *batch, size_t filled, size_t lines) {
+    size_t want = batch_bytes > filled ? batch_bytes - filled : 0;
+    if (in->lines > 0) {
+        size_t expected = lines * (in->bytes / in->lines + 1);
+        if (expected < want) {
+            want = expected;
+        }
+    }
+    if (want < MIN_READ) {
+        want = MIN_READ;
+    }
+    return want < batch->capacity - filled ? want : batch->capacity - filled;
+}
+
+/* Input Thread Function: Reads standard input a batch at a time. Lines have no length limit: one that
+ * does not fit grows the batch.
+*/
+void *get_input(void *args) {
+    (void)args;
+    bool interactive = isatty(STDIN_FILENO);    // Hand each batch on at once rather than RING_BATCH at a time
+    bool stop = false;
+    unsigned long seq = 0;
+    double pending_since = 0;   // When the oldest batch put in edges[0] and not yet flushed went in
+
+    while (!stop) {
+        struct batch *batch = get_from_buffer(&free_batches, edge_buffer(&edges[0], seq));
+        double start = stats ? now_seconds() : 0;
+        double deadline = 0;
+        bool timed_out = false;
+        batch->n_lines = 0;
+        batch->size = 0;
+
+        // Start with what earlier reads left over. Only once that has run out does the batch read more,
+        // so there is never more to carry over than the last read.
+        size_t filled = carried_lines(&input);  // Bytes in text; the lines taken end at batch->size
+        size_t scanned = 0;                     // No newline in text[batch->size, scanned)
+        grow_batch(batch, filled + MIN_READ);
+        if (filled > 0) {
+            memcpy(batch->text, input.carry + input.pos, filled);
+            input.pos += filled;
         }
 
-        // Iterate through the entire string and replace newline characters with spaces
-        for (int i = 0; line[i] != '\0'; i++) {
-            if (line[i] == '\n') {
-                line[i] = ' ';
+        while (batch->n_lines < batch_lines && batch->size < batch_bytes) {
+            // Take the next complete line, if there is one
+            char *newline = memchr(batch->text + scanned, '\n', filled - scanned);
+            if (newline) {
+                size_t end = newline - batch->text + 1;
+                if (end - batch->size == 5 && memcmp(batch->text + batch->size, "STOP\n", 5) == 0) {
+                    stop = true;
+                    break;
+                }
+                input.bytes += end - batch->size;
+                input.lines++;
+                batch->size = scanned = end;
+                batch->ends[batch->n_lines++] = end;
+                TRACE_FIRST_LINE(batch);
+                continue;
             }
+            scanned = filled;
+
+            // Do not hold lines back longer than flush_ms waiting for more: neither this batch's nor those of
+            // batches already put in edges[0], which the next stage cannot see until they are flushed
+            if (batch->n_lines > 0 || pending_since > 0) {
+                if (batch->n_lines > 0 && deadline == 0) {
+                    deadline = now_seconds() + flush_ms / 1000.0;
+                }
+                double wait_until = deadline;
+                if (pending_since > 0 && (wait_until == 0 || pending_since + flush_ms / 1000.0 < wait_until)) {
+                    wait_until = pending_since + flush_ms / 1000.0;
+                }
+                double wait_start = stats ? now_seconds() : 0;
+                bool ready = input_ready(&input, wait_until);
+                if (stats) {
+                    start += now_seconds() - wait_start;    // Waiting for input is not busy time
+                }
+                if (!ready && batch->n_lines > 0) {
+                    timed_out = true;
+                    break;
+                }
+                if (!ready) {
+                    // Nothing of this batch yet: publish the earlier ones before read() blocks
+                    flush_edge(&edges[0], 0);
+                    pending_since = 0;
+                }
+            }
+
+            if (batch->capacity - filled < MIN_READ) {
+                grow_batch(batch, filled + MIN_READ);
+            }
+            size_t n = read_input(&input, batch->text + filled,
+                                  read_size(&input, batch, filled, batch_lines - batch->n_lines));
+            if (n == 0) {
+                // End of input: an unterminated last line is still a line
+                if (filled > batch->size) {
+                    batch->size = filled;
+                    batch->ends[batch->n_lines++] = filled;
+                    TRACE_FIRST_LINE(batch);
+                }
+                stop = true;
+                break;
+            }
+            filled += n;
         }
 
-        // Put the modified line into buffer_2
-        put_in_buffer(buffer_2, &prod_idx_2, &count_2, &mutex_buffer_2, &cond_buffer_2, line);
+        // Keep what was read past the batch's last line for the next batch
+        if (!stop && filled > batch->size && input.pos == input.end) {
+            if (input.capacity < filled - batch->size) {
+                input.capacity = filled - batch->size;
+                free(input.carry);
+                input.carry = malloc(input.capacity);
+                if (!input.carry) {
+                    err(1, "Memory allocation failed");
+                }
+            }
+            input.pos = 0;
+            input.end = filled - batch->size;
+            memcpy(input.carry, batch->text + batch->size, input.end);
+        }
+
+        if (batch->n_lines > 0) {
+            if (stats) {
+                input_stats.busy += now_seconds() - start;
+                input_stats.batches++;
+                input_stats.lines += batch->n_lines;
+                input_stats.bytes += batch->size;
+            }
+            batch->seq = seq;
+            struct buffer *next = edge_buffer(&edges[0], seq++);
+            put_in_buffer(next, batch);
+            if (timed_out || interactive) {
+                flush_edge(&edges[0], 0);
+                pending_since = 0;
+            } else if (pending_since == 0) {
+                pending_since = now_seconds();
+            }
+        }
     }
 
+    // STOP or end of input: pass the poison pill on so the other stages finish too
+    pass_poison_pill(&edges[0], 0);
     return NULL;
 }
 
-/* Plus Sign Thread Function:Replaces every pair of plus signs, i.e., "++", by a "^"
+/* Account for a batch a stage has finished with, started at start
 */
-void *replace_plus_sign(void *args) {
-    while (1) {
-        char* line = get_from_buffer(buffer_2, &prod_idx_2, &con_idx_2, &count_2, &mutex_buffer_2, &cond_buffer_2);
+void count_batch(struct stage_stats *s, struct batch const *batch, size_t bytes_in, double start) {
+    s->busy += now_seconds() - start;
+    s->batches++;
+    s->lines += batch->n_lines;
+    s->bytes += bytes_in;
+}
+
+/* Line Separator Filter: Replaces every line separator in the batch by a space
+*/
+void replace_line_separator(struct batch *batch) {
+    mtp_replace_newlines(batch->text, batch->size);
+}
+
+/* Plus Sign Filter: Replaces every pair of plus signs, i.e., "++", by a "^". It goes line by line, as a
+ * pair never spans two lines. The result is never longer, so each line is written over the batch itself,
+ * moved down by what earlier lines lost.
+*/
+void replace_plus_sign(struct batch *batch) {
+    size_t line_start = 0, j = 0;
+    for (size_t k = 0; k < batch->n_lines; k++) {
+        size_t end = batch->ends[k];
+        j += mtp_replace_plus(batch->text + j, batch->text + line_start, end - line_start);
+        batch->ends[k] = j;
+        line_start = end;
+    }
+    batch->size = j;
+}
 
-        // Check for the stop-processing condition/poison pill
-        if (strcmp(line, POISON_PILL) == 0) {
-            put_in_buffer(buffer_3, &prod_idx_3, &count_3, &mutex_buffer_3, &cond_buffer_3, POISON_PILL);
+/* The filters -s can name. A new one needs a function here and nothing else: batches always hold whole
+ * lines, so a filter never has to look past the batch it is given.
+*/
+static struct filter const filters[] = {
+    {"newline", replace_line_separator, true},
+    {"plus", replace_plus_sign, false},
+};
+#define N_FILTERS (sizeof(filters) / sizeof(filters[0]))
+
+/* Stage Thread Function: Runs a stage's filters on its share of the batches, in order, and passes them
+ * on. args is a struct stage_thread.
+*/
+void *run_stage(void *args) {
+    struct stage_thread const *st = args;
+    struct stage *stage = st->stage;
+    int thread = st->thread;
+    struct stage_stats *s = &stage->stats[thread];
+
+    for (unsigned long seq = thread;; seq += stage->threads) {
+        struct buffer *out = edge_buffer(stage->out, seq);
+        struct batch *batch = get_from_buffer(edge_buffer(stage->in, seq), out);
+
+        // Check for the stop-processing condition, i.e., poison pill
+        if (batch == POISON_PILL) {
+            pass_poison_pill(stage->out, thread);
             break;
         }
+        double start = stats ? now_seconds() : 0;
+        size_t size_in = batch->size;
+
+        for (int f = 0; f < stage->n_filters; f++) {
+            stage->filters[f]->apply(batch);
+        }
+
+        if (stats) {
+            count_batch(s, batch, size_in, start);
+        }
+        put_in_buffer(out, batch);
+    }
+    return NULL;
+}
+
+/* Set up the stages from a spec: stages separated by commas, each one or more filters joined with '+'
+ * and run on one thread, or on N threads taking turns with "*N". "newline,plus" (the default) is the
+ * line separator and plus sign stages; "newline+plus*4" is both on each of four threads. A stage of
+ * cheap filters with no thread count is merged into the next stage (or the one before, if it is last),
+ * as handing a batch to another thread costs more than running it there.
+*/
+void parse_stages(const char *spec) {
+    char *copy = strdup(spec);
+    if (!copy) {
+        err(1, "Memory allocation failed");
+    }
+    char *stage_save;
+    for (char *text = strtok_r(copy, ",", &stage_save); text; text = strtok_r(NULL, ",", &stage_save)) {
+        if (n_stages == MAX_STAGES) {
+            errx(1, "Too many stages: %s", spec);
+        }
+        struct stage *stage = &stages[n_stages++];
+        stage->threads = 1;
+        char *threads = strchr(text, '*');
+        if (threads) {
+            char *end;
+            *threads++ = '\0';
+            long n = strtol(threads, &end, 10);
+            if (*threads == '\0' || *end != '\0' || n < 1 || n > MAX_THREADS) {
+                errx(1, "Invalid thread count in stage %s: %s", text, threads);
+            }
+            stage->threads = n;
+            stage->pinned = true;
+        }
+        char *filter_save;
+        for (char *name = strtok_r(text, "+", &filter_save); name; name = strtok_r(NULL, "+", &filter_save)) {
+            size_t f = 0;
+            while (f < N_FILTERS && strcmp(filters[f].name, name) != 0) {
+                f++;
+            }
+            if (f == N_FILTERS) {
+                errx(1, "Unknown filter: %s (one of newline, plus)", name);
+            }
+            if (stage->n_filters == MAX_STAGE_FILTERS) {
+                errx(1, "Too many filters in one stage: %s", spec);
+            }
+            stage->filters[stage->n_filters++] = &filters[f];
+        }
+        if (stage->n_filters == 0) {
+            errx(1, "Empty stage in %s", spec);
+        }
+    }
+    free(copy);
 
-        // Allocate memory for the modified string. It might be shorter, but never longer.
-        char* new_line = malloc(strlen(line) + 1);
-        if (new_line == NULL) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(1); 
+    // Co-schedule cheap stages with their neighbours
+    for (int k = 0; k < n_stages && n_stages > 1;) {
+        struct stage *stage = &stages[k];
+        bool cheap = !stage->pinned;
+        for (int f = 0; f < stage->n_filters; f++) {
+            cheap = cheap && stage->filters[f]->cheap;
+        }
+        struct stage *into = k + 1 < n_stages ? &stages[k + 1] : &stages[k - 1];
+        if (!cheap || into->n_filters + stage->n_filters > MAX_STAGE_FILTERS) {
+            k++;
+            continue;
         }
+        if (into > stage) {
+            memmove(into->filters + stage->n_filters, into->filters, into->n_filters * sizeof(into->filters[0]));
+            memcpy(into->filters, stage->filters, stage->n_filters * sizeof(stage->filters[0]));
+        } else {
+            memcpy(into->filters + into->n_filters, stage->filters, stage->n_filters * sizeof(stage->filters[0]));
+        }
+        into->n_filters += stage->n_filters;
+        memmove(stage, stage + 1, (n_stages - k - 1) * sizeof(*stage));
+        n_stages--;
+    }
 
-        // Iterate through the string and replace "++" with "^"
-        int i = 0, j = 0;
-        while (line[i] != '\0') {
-            if (line[i] == '+' && line[i + 1] == '+') {
-                new_line[j++] = '^';
-                i += 2; // Skip over the second "+"
+    for (int k = 0; k < n_stages; k++) {
+        struct stage *stage = &stages[k];
+        size_t len = 0;
+        for (int f = 0; f < stage->n_filters; f++) {
+            len += snprintf(stage->name + len, sizeof(stage->name) - len, "%s%s", f ? "+" : "",
+                            stage->filters[f]->name);
+            if (len >= sizeof(stage->name)) {
+                errx(1, "Stage name too long: %s", spec);
+            }
+        }
+        for (int t = 0; t < stage->threads; t++) {
+            if (stage->threads == 1) {
+                strcpy(stage->thread_names[t], stage->name);
             } else {
-                new_line[j++] = line[i++];
+                snprintf(stage->thread_names[t], sizeof(stage->thread_names[t]), "%.*s/%d", STAGE_NAME - 1, stage->name, t);
             }
+            stage->stats[t].name = stage->thread_names[t];
         }
-        new_line[j] = '\0';
+    }
+}
+
+/* Set up the buffers from a stage of from threads to one of to threads
+*/
+void init_edge(struct edge *e, int from, int to) {
+    e->from = from;
+    e->to = to;
+    e->buffers = aligned_alloc(CACHE_LINE, from * to * sizeof(struct buffer));
+    if (!e->buffers) {
+        err(1, "Memory allocation failed");
+    }
+    // Between single threads, indices can be handed over a few items at a time. Where a thread takes
+    // from several buffers in turn, it must not wait for an item its producer is still holding back.
+    for (int i = 0; i < from * to; i++) {
+        init_buffer(&e->buffers[i], queue_capacity, from > 1 || to > 1);
+    }
+}
 
-        // Put the modified line into buffer_3
-        put_in_buffer(buffer_3, &prod_idx_3, &count_3, &mutex_buffer_3, &cond_buffer_3, new_line);
+/* The buffer batch number seq goes through
+*/
+struct buffer *edge_buffer(struct edge const *e, unsigned long seq) {
+    return &e->buffers[seq % e->from * e->to + seq % e->to];
+}
 
-        // Free the memory allocated for the new_line
-        free(new_line);
+/* Publish everything thread has put in its buffers of e
+*/
+void flush_edge(struct edge const *e, int thread) {
+    for (int i = 0; i < e->to; i++) {
+        flush_buffer(&e->buffers[thread * e->to + i]);
     }
+}
 
-    return NULL;
+/* Stop every thread of the next stage: each is waiting on one of the buffers from thread to them
+*/
+void pass_poison_pill(struct edge const *e, int thread) {
+    for (int i = 0; i < e->to; i++) {
+        put_in_buffer(&e->buffers[thread * e->to + i], POISON_PILL);
+        flush_buffer(&e->buffers[thread * e->to + i]);
+    }
 }
 
-/* Output Thread Function: Writes the processed data to standard output as lines of exactly 80 characters
+/* Start get_input, the stages and write_output, each on their threads, wait for them to finish, and
+ * print their --stats
+*/
+void run_pipeline(void) {
+    int total = 0;
+    for (int k = 0; k <= n_stages; k++) {
+        init_edge(&edges[k], k == 0 ? 1 : stages[k - 1].threads, k == n_stages ? 1 : stages[k].threads);
+    }
+    for (int k = 0; k < n_stages; k++) {
+        stages[k].in = &edges[k];
+        stages[k].out = &edges[k + 1];
+        total += stages[k].threads;
+    }
+
+    pthread_t input_thread, output_thread, *stage_threads = malloc(total * sizeof(pthread_t));
+    struct stage_thread *stage_args = malloc(total * sizeof(struct stage_thread));
+    if (!stage_threads || !stage_args) {
+        err(1, "Memory allocation failed");
+    }
+    pthread_create(&input_thread, NULL, get_input, NULL);
+    for (int k = 0, n = 0; k < n_stages; k++) {
+        for (int t = 0; t < stages[k].threads; t++, n++) {
+            stage_args[n] = (struct stage_thread){.stage = &stages[k], .thread = t};
+            pthread_create(&stage_threads[n], NULL, run_stage, &stage_args[n]);
+        }
+    }
+    pthread_create(&output_thread, NULL, write_output, NULL);
+
+    pthread_join(input_thread, NULL);
+    for (int n = 0; n < total; n++) {
+        pthread_join(stage_threads[n], NULL);
+    }
+    pthread_join(output_thread, NULL);
+    free(stage_threads);
+    free(stage_args);
+
+    if (report_stats) {
+        print_stats(&input_stats);
+        for (int k = 0; k < n_stages; k++) {
+            for (int t = 0; t < stages[k].threads; t++) {
+                print_stats(&stages[k].stats[t]);
+            }
+        }
+        print_stats(&output_stats);
+    }
+}
+
+/* Write all of buf to standard output, however many write() calls that takes. Returns how many it took.
+*/
+unsigned long write_all(const char *buf, size_t len) {
+    unsigned long calls = 0;
+    while (len > 0) {
+        calls++;
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            err(1, "Failed to write output");
+        }
+        buf += n;
+        len -= n;
+    }
+    return calls;
+}
+
+/* Output being framed into 80-character lines and gathered up for write()
+*/
+struct output {
+    size_t column;          // Characters in the line being built
+    size_t n_out;           // Bytes in buf, the line being built included
+    unsigned long writes;   // write() calls so far
+    char buf[OUTPUT_RECORDS * 81];
+};
+
+void output_init(struct output *o) {
+    o->column = 0;
+    o->n_out = 0;
+    o->writes = 0;
+}
+
+/* Write out every complete line gathered so far; the line being built stays
+*/
+void output_flush(struct output *o) {
+    size_t complete = o->n_out - o->column;
+    if (complete == 0) return;
+    o->writes += write_all(o->buf, complete);
+    memmove(o->buf, o->buf + complete, o->column);
+    o->n_out = o->column;
+}
+
+/* Finish an 80-character output line, writing the buffer out once it is full
+*/
+static void output_end_line(struct output *o) {
+    o->buf[o->n_out++] = '\n';
+    o->column = 0;
+    if (o->n_out == sizeof(o->buf)) {
+        output_flush(o);
+    }
+}
+
+/* Append one character to the output
+*/
+static inline void output_char(struct output *o, char c) {
+    o->buf[o->n_out++] = c;
+    if (++o->column == 80) {
+        output_end_line(o);
+    }
+}
+
+/* Append a run of characters
+*/
+static void output_copy(struct output *o, const char *p, size_t n) {
+    while (n > 0) {
+        size_t take = 80 - o->column < n ? 80 - o->column : n;
+        memcpy(o->buf + o->n_out, p, take);
+        o->n_out += take;
+        o->column += take;
+        p += take;
+        n -= take;
+        if (o->column == 80) {
+            output_end_line(o);
+        }
+    }
+}
+
+/* Output Thread Function: Writes the processed data to standard output as lines of exactly 80 characters,
+ * OUTPUT_RECORDS lines to a write() while input keeps coming, and whatever is complete as soon as it
+ * runs dry. A trailing partial line is never written.
 */
 void *write_output(void *args) {
-    char output_line[81] = {0}; // Buffer for exactly 80 characters + '\n'
-    int output_index = 0; // Index for adding characters to output_line
+    (void)args;
+    struct output *out = malloc(sizeof(*out));
+    if (!out) {
+        err(1, "Memory allocation failed");
+    }
+    output_init(out);
 
-    while (1) {
-        char *line = get_from_buffer(buffer_3, &prod_idx_3, &con_idx_3, &count_3, &mutex_buffer_3, &cond_buffer_3);
+    for (unsigned long seq = 0;; seq++) {
+        struct batch *batch = get_from_buffer(edge_buffer(&edges[n_stages], seq), &free_batches);
 
         // Check for the stop-processing condition, i.e., poison pill
-        if (strcmp(line, POISON_PILL) == 0) {
+        if (batch == POISON_PILL) {
             break; // Exit loop
         }
+        double start = stats ? now_seconds() : 0;
+
+        output_copy(out, batch->text, batch->size);
+        TRACE_OUTPUT(batch);
+
+        // Nothing more to go on with: write out what is complete rather than sit on it
+        if (buffer_empty(edge_buffer(&edges[n_stages], seq + 1))) {
+            output_flush(out);
+        }
+
+        // Done with the batch: back to the free list for get_input
+        if (stats) {
+            count_batch(&output_stats, batch, batch->size, start);
+        }
+        put_in_buffer(&free_batches, batch);
+    }
+
+    output_flush(out);
+    output_stats.syscalls = out->writes;
+    free(out);
+    return NULL;
+}
+
+/* State of the --fused transform between input blocks
+*/
+struct fused_state {
+    int stop_matched;   // Characters of "STOP\n" matched at the start of the current line; -1 past that
+    bool plus;          // A '+' is held back: "^" if the next character is '+' too, otherwise itself
+    unsigned long lines;
+    struct output out;
+};
+
+/* Run one block of input through the state machine. Everything that depends on what comes next (a '+'
+ * that may pair with the next character, the start of a line that may be STOP) is carried over in f, so
+ * blocks can end anywhere. Returns true at STOP.
+*/
+bool fused_block(struct fused_state *f, const char *p, size_t n) {
+    static const char stop_line[] = "STOP\n";
+    for (size_t i = 0; i < n; i++) {
+        // Inside a line with nothing held back, copy up to the next '+' or newline as it is
+        if (f->stop_matched < 0 && !f->plus) {
+            size_t run = mtp_find_special(p + i, n - i);
+            output_copy(&f->out, p + i, run);
+            i += run;
+            if (i == n) break;
+        }
+
+        char c = p[i];
+        if (f->stop_matched >= 0) {
+            if (c == stop_line[f->stop_matched]) {
+                if (++f->stop_matched == 5) return true;
+                continue;
+            }
+            // Not STOP after all: what matched so far is ordinary text
+            for (int k = 0; k < f->stop_matched; k++) {
+                output_char(&f->out, stop_line[k]);
+            }
+            f->stop_matched = -1;
+        }
+        if (f->plus) {
+            f->plus = false;
+            if (c == '+') {
+                output_char(&f->out, '^');
+                continue;
+            }
+            output_char(&f->out, '+');
+        }
+        if (c == '+') {
+            f->plus = true;
+        } else if (c == '\n') {
+            output_char(&f->out, ' ');
+            f->stop_matched = 0;
+            f->lines++;
+        } else {
+            output_char(&f->out, c);
+        }
+    }
+    return false;
+}
 
-        int line_length = strlen(line);
-        for (int i = 0; i < line_length; ++i) {
-            output_line[output_index++] = line[i];
-            
-            // Once we have accumulated 80 characters, print them and reset the index
-            if (output_index == 80) {
-                output_line[80] = '\n'; 
-                write(STDOUT_FILENO, output_line, 81); // Write the 80 characters + '\n' to stdout
-                output_index = 0; 
+/* Map standard input if it is a regular file, so --fused can work on the page cache directly. Returns
+ * the mapping and sets *start to where input starts in it and *size to its size; NULL if it cannot be
+ * mapped, in which case standard input is read as usual.
+*/
+char const *map_input(size_t *start, size_t *size) {
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) < 0 || !S_ISREG(st.st_mode)) return NULL;
+    off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    if (offset < 0 || st.st_size <= offset) return NULL;
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if (st.st_size <= POPULATE_BYTES) {
+        flags |= MAP_POPULATE;  // Fault it all in at once rather than a page at a time
+    }
+#endif
+    char *map = mmap(NULL, st.st_size, PROT_READ, flags, STDIN_FILENO, 0);
+    if (map == MAP_FAILED) return NULL;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    *start = offset;
+    *size = st.st_size;
+    return map;
+}
+
+/* One block of --fused input, counted for --stats. Returns true at STOP.
+*/
+bool fused_input(struct fused_state *f, const char *p, size_t n) {
+    double start = stats ? now_seconds() : 0;
+    unsigned long lines = f->lines;
+    bool stop = fused_block(f, p, n);
+    if (stats) {
+        fused_stats.busy += now_seconds() - start;
+        fused_stats.batches++;
+        fused_stats.lines += f->lines - lines;
+        fused_stats.bytes += n;
+    }
+    return stop;
+}
+
+/* --fused: the whole pipeline on one thread as a single streaming pass, newline to space, "++" to "^"
+ * and 80-column framing together, over the mapped input file or large read() blocks and with large
+ * write()s.
+*/
+void run_fused(void) {
+    struct fused_state *f = malloc(sizeof(*f));
+    if (!f) {
+        err(1, "Memory allocation failed");
+    }
+    f->stop_matched = 0;
+    f->plus = false;
+    f->lines = 0;
+    output_init(&f->out);
+
+    bool stop = false;
+    size_t pos, size;
+    char const *map = map_input(&pos, &size);
+    if (map) {
+        for (; !stop && pos < size; pos += FUSED_READ_SIZE) {
+            stop = fused_input(f, map + pos, size - pos < FUSED_READ_SIZE ? size - pos : FUSED_READ_SIZE);
+        }
+        munmap((void *)map, size);
+    } else {
+        char *block = malloc(FUSED_READ_SIZE);
+        if (!block) {
+            err(1, "Memory allocation failed");
+        }
+        while (!stop) {
+            // Do not hold finished lines back longer than flush_ms while read() waits for more input
+            if (f->out.n_out > f->out.column) {
+                struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+                fused_stats.syscalls++;
+                if (poll(&pfd, 1, flush_ms) == 0) {
+                    output_flush(&f->out);
+                }
+            }
+            fused_stats.syscalls++;
+            ssize_t n = read(STDIN_FILENO, block, FUSED_READ_SIZE);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                err(1, "Failed to read input");
             }
+            if (n == 0) break;
+            stop = fused_input(f, block, n);
         }
+        free(block);
     }
+    if (!stop) {
+        // End of input without STOP: a held-back "STO" or '+' is ordinary text
+        for (int k = 0; k < f->stop_matched; k++) {
+            output_char(&f->out, "STOP"[k]);
+        }
+        if (f->plus) {
+            output_char(&f->out, '+');
+        }
+    }
+    output_flush(&f->out);
+    if (stats) {
+        fused_stats.syscalls += f->out.writes;
+    }
+    free(f);
+}
+
+#ifdef MTP_TRACE
+uint64_t trace_start_ns;
+uint64_t latency[LATENCY_BUCKETS];      // Lines by time from get_input to write_output
+uint64_t latency_max_ns;
+pthread_t trace_thread;
+bool trace_done = false;
+
+/* Occupancy bucket of a put that found items in the buffer
+*/
+void trace_put(struct queue_trace *t, size_t items) {
+    int bucket = items == 0 ? 0 : 64 - __builtin_clzll(items);
+    TRACE_ADD(t->puts, 1);
+    TRACE_ADD(t->occupancy[bucket < TRACE_BUCKETS ? bucket : TRACE_BUCKETS - 1], 1);
+}
+
+/* Latency bucket of ns: the power of two below it, and which quarter of the way to the next one
+*/
+static int latency_bucket(uint64_t ns) {
+    if (ns < 4) return ns;
+    int log = 63 - __builtin_clzll(ns);
+    return log * 4 + ((ns >> (log - 2)) & 3);
+}
 
+/* Upper bound of a latency bucket
+*/
+static uint64_t latency_bucket_top(int bucket) {
+    if (bucket < 4) return bucket;
+    int log = bucket / 4;
+    return (1ULL << log) + ((uint64_t)(bucket % 4 + 1) << (log - 2));
+}
+
+/* write_output is done with a batch: its lines count as having taken since the first of them was read,
+ * which for the later ones is an upper bound
+*/
+void trace_latency(struct batch const *batch) {
+    uint64_t ns = trace_ns() - batch->first_line_ns;
+    TRACE_ADD(latency[latency_bucket(ns)], batch->n_lines);
+    if (ns > latency_max_ns) {
+        TRACE_ADD(latency_max_ns, ns - latency_max_ns);
+    }
+}
+
+/* One buffer's counters
+*/
+static void trace_queue(const char *from, const char *to, int i, int j, struct buffer *b) {
+    struct queue_trace *t = &b->trace;
+    fprintf(stderr, "trace: queue=%s->%s from_thread=%d to_thread=%d capacity=%zu puts=%llu gets=%llu "
+            "wait_full=%.6f wait_empty=%.6f occupancy=", from, to, i, j, buffer_capacity(b),
+            (unsigned long long)TRACE_GET(t->puts), (unsigned long long)TRACE_GET(t->gets),
+            TRACE_GET(t->wait_full_ns) / 1e9, TRACE_GET(t->wait_empty_ns) / 1e9);
+    bool first = true;
+    for (int k = 0; k < TRACE_BUCKETS; k++) {
+        uint64_t n = TRACE_GET(t->occupancy[k]);
+        if (n == 0) continue;
+        if (k < 2) {
+            fprintf(stderr, "%s%d:%llu", first ? "" : ",", k, (unsigned long long)n);
+        } else {
+            fprintf(stderr, "%s%llu-%llu:%llu", first ? "" : ",", 1ULL << (k - 1), (1ULL << k) - 1,
+                    (unsigned long long)n);
+        }
+        first = false;
+    }
+    fprintf(stderr, "%s\n", first ? "-" : "");
+}
+
+/* A stage thread's counters, with the time it spent waiting on the buffers either side of it
+*/
+static void trace_stage(struct stage_stats const *s, uint64_t wait_empty_ns, uint64_t wait_full_ns) {
+    double busy = s->busy > 0 ? s->busy : 1e-9;
+    fprintf(stderr, "trace: stage=%s batches=%lu lines=%lu bytes=%llu busy=%.6f lines/s=%.0f MB/s=%.1f "
+            "wait_empty=%.6f wait_full=%.6f\n", s->name, s->batches, s->lines, s->bytes, s->busy,
+            s->lines / busy, s->bytes / 1e6 / busy, wait_empty_ns / 1e9, wait_full_ns / 1e9);
+}
+
+/* Dump everything to stderr as key=value lines: an event line (exit or signal), a stage line per
+ * thread, a queue line per buffer and a latency line with percentiles. Times are in seconds. While
+ * the pipeline runs, the figures are a snapshot taken as the threads go on updating them. --fused has
+ * no buffers to wait on and no lines in flight, so it gets the event line and its one stage line.
+*/
+void trace_dump(const char *event) {
+    fprintf(stderr, "trace: event=%s elapsed=%.6f stages=%d\n", event, (trace_ns() - trace_start_ns) / 1e9,
+            n_stages);
+    if (fused) {
+        trace_stage(&fused_stats, 0, 0);
+        fflush(stderr);
+        return;
+    }
+
+    // Stage threads: waiting for an item is on the buffers in, waiting for room on the buffers out
+    for (int k = 0; k <= n_stages + 1; k++) {
+        struct edge *in = k > 0 ? &edges[k - 1] : NULL, *out = k <= n_stages ? &edges[k] : NULL;
+        int threads = k == 0 || k == n_stages + 1 ? 1 : stages[k - 1].threads;
+        for (int t = 0; t < threads; t++) {
+            uint64_t wait_empty = 0, wait_full = 0;
+            for (int i = 0; in && i < in->from; i++) {
+                wait_empty += TRACE_GET(in->buffers[i * in->to + t].trace.wait_empty_ns);
+            }
+            for (int j = 0; out && j < out->to; j++) {
+                wait_full += TRACE_GET(out->buffers[t * out->to + j].trace.wait_full_ns);
+            }
+            if (k == 0) {
+                trace_stage(&input_stats, wait_empty + TRACE_GET(free_batches.trace.wait_empty_ns), wait_full);
+            } else if (k == n_stages + 1) {
+                trace_stage(&output_stats, wait_empty, wait_full + TRACE_GET(free_batches.trace.wait_full_ns));
+            } else {
+                trace_stage(&stages[k - 1].stats[t], wait_empty, wait_full);
+            }
+        }
+    }
+
+    for (int k = 0; k <= n_stages; k++) {
+        const char *from = k > 0 ? stages[k - 1].name : "input";
+        const char *to = k < n_stages ? stages[k].name : "output";
+        for (int i = 0; i < edges[k].from; i++) {
+            for (int j = 0; j < edges[k].to; j++) {
+                trace_queue(from, to, i, j, &edges[k].buffers[i * edges[k].to + j]);
+            }
+        }
+    }
+    trace_queue("output", "input", 0, 0, &free_batches);   // The free list
+
+    // Latency percentiles over the histogram, each the top of the bucket it falls in (or the maximum)
+    static const double percentiles[] = {50, 90, 99, 99.9};
+    uint64_t max_ns = TRACE_GET(latency_max_ns);
+    uint64_t lines = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        lines += TRACE_GET(latency[b]);
+    }
+    fprintf(stderr, "trace: latency lines=%llu", (unsigned long long)lines);
+    for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++) {
+        uint64_t rank = lines * percentiles[p] / 100, seen = 0;
+        int b = 0;
+        while (b < LATENCY_BUCKETS - 1 && seen + TRACE_GET(latency[b]) <= rank) {
+            seen += TRACE_GET(latency[b++]);
+        }
+        uint64_t top = latency_bucket_top(b) < max_ns ? latency_bucket_top(b) : max_ns;
+        fprintf(stderr, " p%g=%.6f", percentiles[p], lines ? top / 1e9 : 0);
+    }
+    fprintf(stderr, " max=%.6f\n", max_ns / 1e9);
+    fflush(stderr);
+}
+
+/* Dump on every SIGUSR1 until trace_stop(). The signal is blocked in every thread and taken here with
+ * sigwait(), so the dump runs as ordinary code rather than in a signal handler.
+*/
+static void *trace_signals(void *args) {
+    sigset_t *set = args;
+    int sig;
+    while (sigwait(set, &sig) == 0 && !__atomic_load_n(&trace_done, __ATOMIC_ACQUIRE)) {
+        trace_dump("signal");
+    }
     return NULL;
 }
 
+/* Start timing and the SIGUSR1 thread; call before starting any other thread, so they all inherit the
+ * blocked signal
+*/
+void trace_start(void) {
+    static sigset_t set;
+    trace_start_ns = trace_ns();
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_create(&trace_thread, NULL, trace_signals, &set);
+}
+
+/* Stop the SIGUSR1 thread and dump the final figures
+*/
+void trace_stop(void) {
+    __atomic_store_n(&trace_done, true, __ATOMIC_RELEASE);
+    pthread_kill(trace_thread, SIGUSR1);
+    pthread_join(trace_thread, NULL);
+    trace_dump("exit");
+}
+#endif
+
+#ifdef MTP_QUEUE_MUTEX
+/* Set up an empty buffer with room for capacity items. Every put is visible at once, so eager makes no
+ * difference.
+*/
+void init_buffer(struct buffer *buffer, size_t capacity, bool eager) {
+    (void)eager;
+    buffer->items = malloc(capacity * sizeof(buffer->items[0]));
+    if (!buffer->items) {
+        err(1, "Memory allocation failed");
+    }
+    buffer->capacity = capacity;
+    buffer->count = 0;
+    buffer->prod_idx = 0;
+    buffer->con_idx = 0;
+    pthread_mutex_init(&buffer->mutex, NULL);
+    pthread_cond_init(&buffer->cond, NULL);
+}
+
 /* Put an item in a buffer
 */
-void put_in_buffer(char buffer[MAX_LINES][MAX_LINE_LENGTH], int *prod_idx, int *count, pthread_mutex_t *mutex, pthread_cond_t *cond, const char *item) {
+void put_in_buffer(struct buffer *buffer, struct batch *item) {
     // 1. Lock mutex to ensure exclusive access
-    pthread_mutex_lock(mutex);
+    pthread_mutex_lock(&buffer->mutex);
     
     // Wait until there is space in the buffer?
-    while (*count == MAX_LINES) {
-        pthread_cond_wait(cond, mutex);
+    TRACE_PUT(buffer, buffer->count);
+    if (buffer->count == buffer->capacity) {
+        TRACE_WAIT_BEGIN();
+        while (buffer->count == buffer->capacity) {
+            pthread_cond_wait(&buffer->cond, &buffer->mutex);
+        }
+        TRACE_WAIT_END(buffer->trace.wait_full_ns);
     }
     
-    // 2. Copy the item into the buffer
-    strncpy(buffer[*prod_idx], item, MAX_LINE_LENGTH - 1);
-
-    // 3. Ensure null termination
-    buffer[*prod_idx][MAX_LINE_LENGTH - 1] = '\0'; 
+    // 2. Store the item in the buffer; the batch itself stays where it is
+    buffer->items[buffer->prod_idx] = item;
 
-    // 4. Update producer index in a circular manner
-    *prod_idx = (*prod_idx + 1) % MAX_LINES; 
+    // 3. Update producer index in a circular manner
+    buffer->prod_idx = (buffer->prod_idx + 1) % buffer->capacity; 
 
-    // 5. Increment the count of items in the buffer
-    (*count)++; 
+    // 4. Increment the count of items in the buffer
+    buffer->count++; 
 
-    // 6. Signal that a new item has been added
-    pthread_cond_signal(cond); 
+    // 5. Signal that a new item has been added
+    pthread_cond_signal(&buffer->cond); 
 
-    // 7. Unlock the mutex to allow other threads to access the buffer
-    pthread_mutex_unlock(mutex);
+    // 6. Unlock the mutex to allow other threads to access the buffer
+    pthread_mutex_unlock(&buffer->mutex);
 }
 
-/* Get the next item from a buffer
+/* Get the next item from a buffer. Every put signals its consumer, so there is nothing to hand on to
+ * downstream before waiting.
 */
-char *get_from_buffer(char buffer[MAX_LINES][MAX_LINE_LENGTH], int *prod_idx, int *con_idx, int *count, pthread_mutex_t *mutex, pthread_cond_t *cond) {
+struct batch *get_from_buffer(struct buffer *buffer, struct buffer *downstream) {
+    (void)downstream;
+
     // 1. Lock buffer
-    pthread_mutex_lock(mutex);
+    pthread_mutex_lock(&buffer->mutex);
 
     // 2. If buffer is empty, wait for the producer to signal that the buffer has data
-    while (*count == 0) {
-        pthread_cond_wait(cond, mutex);
+    if (buffer->count == 0) {
+        TRACE_WAIT_BEGIN();
+        while (buffer->count == 0) {
+            pthread_cond_wait(&buffer->cond, &buffer->mutex);
+        }
+        TRACE_WAIT_END(buffer->trace.wait_empty_ns);
     }
+    TRACE_GET_ITEM(buffer);
 
     // 3. Retrieve the item
-    char *item = buffer[*con_idx];
+    struct batch *item = buffer->items[buffer->con_idx];
 
     // 4. Update consumer index in a circular manner
-    *con_idx = (*con_idx + 1) % MAX_LINES;
+    buffer->con_idx = (buffer->con_idx + 1) % buffer->capacity;
 
     // 5. Decrease the count of items in the buffer
-    (*count)--;
+    buffer->count--;
 
     // 6. Signal that space might be available in the buffer
-    pthread_cond_signal(cond);
+    pthread_cond_signal(&buffer->cond);
 
     // 7. Unlock the mutex
-    pthread_mutex_unlock(mutex);
+    pthread_mutex_unlock(&buffer->mutex);
 
-    // 8. Return the item
+    // 8. Return the item, which now belongs to this stage
     return item;
 }
+
+/* Puts are visible to the consumer immediately
+*/
+void flush_buffer(struct buffer *buffer) {
+    (void)buffer;
+}
+
+/* Whether get_from_buffer() would have to wait
+*/
+bool buffer_empty(struct buffer *buffer) {
+    pthread_mutex_lock(&buffer->mutex);
+    bool empty = buffer->count == 0;
+    pthread_mutex_unlock(&buffer->mutex);
+    return empty;
+}
+
+size_t buffer_capacity(struct buffer const *buffer) {
+    return buffer->capacity;
+}
+#else
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+}
+
+/* Wait until *index moves on from seen and return its new value: spin for a while, then sleep on it.
+ * The sleeping flag tells the other side to issue a wakeup; it is set before the final check of the
+ * index and the other side stores the index before checking the flag, so one of them always sees the
+ * other.
+*/
+static uint32_t wait_for_index(_Atomic uint32_t *index, _Atomic uint32_t *sleeping, uint32_t seen) {
+    for (int i = 0; i < ring_spin; i++) {
+        uint32_t now = atomic_load_explicit(index, memory_order_acquire);
+        if (now != seen) return now;
+        cpu_relax();
+    }
+    while (1) {
+        atomic_store(sleeping, 1);
+        uint32_t now = atomic_load(index);
+        if (now != seen) {
+            atomic_store_explicit(sleeping, 0, memory_order_relaxed);
+            return now;
+        }
+#ifdef __linux__
+        syscall(SYS_futex, index, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+#else
+        sched_yield();
+#endif
+    }
+}
+
+/* Store a new index value and wake the other side if it went to sleep waiting for it
+*/
+static void publish_index(_Atomic uint32_t *index, _Atomic uint32_t *sleeping, uint32_t value) {
+    atomic_store(index, value);
+    if (atomic_load(sleeping) && atomic_exchange(sleeping, 0)) {
+#ifdef __linux__
+        syscall(SYS_futex, index, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+    }
+}
+
+/* Set up an empty ring with room for capacity items. Its consumer hands slots back only every
+ * publish_every items, so that many more slots are added to keep the room really there. eager rings
+ * publish every item: for buffers whose consumer also takes from others in turn, and for small rings,
+ * where a few items held back can be all there are.
+*/
+void init_buffer(struct buffer *buffer, size_t capacity, bool eager) {
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->publish_every = eager || capacity < 2 * RING_BATCH ? 1 : RING_BATCH;
+    buffer->slots = 1;
+    while (buffer->slots < capacity + buffer->publish_every - 1) {
+        buffer->slots *= 2;
+    }
+    buffer->items = malloc(buffer->slots * sizeof(buffer->items[0]));
+    if (!buffer->items) {
+        err(1, "Memory allocation failed");
+    }
+}
+
+/* Put an item in a buffer. The line becomes visible to the consumer at the next batch boundary or
+ * flush_buffer().
+*/
+void put_in_buffer(struct buffer *buffer, struct batch *item) {
+    // Wait for a free slot, handing over everything already written first
+    TRACE_PUT(buffer, buffer->prod_idx - atomic_load_explicit(&buffer->head, memory_order_relaxed));
+    while (buffer->prod_idx - buffer->head_seen == buffer->slots) {
+        buffer->head_seen = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        if (buffer->prod_idx - buffer->head_seen == buffer->slots) {
+            flush_buffer(buffer);
+            TRACE_WAIT_BEGIN();
+            buffer->head_seen = wait_for_index(&buffer->head, &buffer->producer_sleeping, buffer->head_seen);
+            TRACE_WAIT_END(buffer->trace.wait_full_ns);
+        }
+    }
+
+    buffer->items[buffer->prod_idx++ & (buffer->slots - 1)] = item;
+
+    if (buffer->prod_idx % buffer->publish_every == 0) {
+        flush_buffer(buffer);
+    }
+}
+
+/* Get the next item from a buffer; it now belongs to this stage. Before waiting on an empty buffer, the
+ * items this stage has put in downstream are published so the next stage is never left waiting on them.
+*/
+struct batch *get_from_buffer(struct buffer *buffer, struct buffer *downstream) {
+    while (buffer->con_idx == buffer->tail_seen) {
+        buffer->tail_seen = atomic_load_explicit(&buffer->tail, memory_order_acquire);
+        if (buffer->con_idx == buffer->tail_seen) {
+            // Empty: let the producer have every slot back and pass on our own output before waiting
+            publish_index(&buffer->head, &buffer->producer_sleeping, buffer->con_idx);
+            if (downstream) {
+                flush_buffer(downstream);
+            }
+            TRACE_WAIT_BEGIN();
+            buffer->tail_seen = wait_for_index(&buffer->tail, &buffer->consumer_sleeping, buffer->tail_seen);
+            TRACE_WAIT_END(buffer->trace.wait_empty_ns);
+        }
+    }
+    TRACE_GET_ITEM(buffer);
+
+    struct batch *item = buffer->items[buffer->con_idx++ & (buffer->slots - 1)];
+    if (buffer->con_idx % buffer->publish_every == 0) {
+        publish_index(&buffer->head, &buffer->producer_sleeping, buffer->con_idx);
+    }
+    return item;
+}
+
+/* Publish every line put so far to the consumer
+*/
+void flush_buffer(struct buffer *buffer) {
+    if (atomic_load_explicit(&buffer->tail, memory_order_relaxed) != buffer->prod_idx) {
+        publish_index(&buffer->tail, &buffer->consumer_sleeping, buffer->prod_idx);
+    }
+}
+
+/* Whether get_from_buffer() would have to wait: nothing published beyond what the consumer has taken
+*/
+bool buffer_empty(struct buffer *buffer) {
+    if (buffer->con_idx != buffer->tail_seen) return false;
+    buffer->tail_seen = atomic_load_explicit(&buffer->tail, memory_order_acquire);
+    return buffer->con_idx == buffer->tail_seen;
+}
+
+size_t buffer_capacity(struct buffer const *buffer) {
+    return buffer->slots;
+}
+#endif
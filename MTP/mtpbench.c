@@ -0,0 +1,214 @@
+/* Throughput benchmark for mtp builds and modes: for each input size, generates that many lines of
+   text (random lengths up to 160 characters, with plenty of "+" runs), then runs each COMMAND on it with
+   stdout going to a pipe it drains, and reports lines/sec and MB/s for the best of several runs,
+   followed by whatever the command wrote to stderr in that run (the per-stage figures, with --stats).
+   Every command has to produce the same output as the first, so the builds and settings are checked
+   against each other at the same time.
+
+   Usage: mtpbench [LINES[,LINES...] [COMMAND...]]    (a COMMAND is a program and its arguments,
+                                                       separated by spaces)
+   By default it runs 1000, 30000 and 1000000 lines through both queue builds unbatched, the default
+   build at several batch sizes, with the line separator on a thread of its own, with four workers,
+   and --fused.
+*/
+
+#include <stdio.h>      // Standard input and output
+#include <stdlib.h>     // malloc(), free(), rand()
+#include <stdint.h>     // Extra fixed-width data types
+#include <string.h>     // strlen(), strtok()
+#include <err.h>        // Convenience functions for error reporting (non-standard)
+#include <errno.h>      // EINTR
+#include <stdbool.h>    // Boolean type and values
+#include <time.h>       // clock_gettime()
+#include <unistd.h>     // fork(), pipe(), dup2(), execv()
+#include <sys/wait.h>   // waitpid()
+
+#define BENCH_REPS 3                                        /* Best of this many runs, or of BENCH_SMALL_REPS ... */
+#define BENCH_SMALL_REPS 20
+#define BENCH_SMALL_LINES 100000                            /* ... for inputs under this many lines */
+#define BENCH_MAX_LINE 160
+#define BENCH_MAX_ARGS 32
+#define BENCH_MAX_STDERR 4096
+
+static char const bench_charset[] = "abcdefghij klmnop+++++\t";
+
+static double elapsed_seconds(struct timespec const *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Input file: n_lines random lines then STOP. Returns its size.
+*/
+static size_t make_input(FILE *file, long n_lines) {
+    size_t size = 0;
+    char line[BENCH_MAX_LINE + 2];
+    for (long i = 0; i < n_lines; i++) {
+        int len = rand() % (BENCH_MAX_LINE + 1);
+        for (int j = 0; j < len; j++) {
+            line[j] = bench_charset[rand() % (sizeof(bench_charset) - 1)];
+        }
+        line[len] = '\n';
+        if (fwrite(line, 1, len + 1, file) != (size_t)len + 1) {
+            err(1, "Failed to write the benchmark input");
+        }
+        size += len + 1;
+    }
+    if (fputs("STOP\n", file) == EOF || fflush(file) == EOF) {
+        err(1, "Failed to write the benchmark input");
+    }
+    return size;
+}
+
+/* Run argv with stdin from in_fd and stderr to err_fd, and return the wall time; *digest gets a hash of
+   its output
+*/
+static double run_once(char *const argv[], int in_fd, int err_fd, uint64_t *digest) {
+    char const *program = argv[0];
+    int out[2];
+    if (pipe(out) < 0) {
+        err(1, "pipe");
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid < 0) {
+        err(1, "fork");
+    }
+    if (pid == 0) {
+        if (lseek(in_fd, 0, SEEK_SET) < 0 || dup2(in_fd, STDIN_FILENO) < 0 || dup2(out[1], STDOUT_FILENO) < 0 ||
+            ftruncate(err_fd, 0) < 0 || lseek(err_fd, 0, SEEK_SET) < 0 || dup2(err_fd, STDERR_FILENO) < 0) {
+            err(1, "Failed to set up %s", program);
+        }
+        close(out[0]);
+        close(out[1]);
+        execv(program, argv);
+        err(127, "Failed to run %s", program);
+    }
+    close(out[1]);
+
+    // FNV-1a over everything the program writes
+    uint64_t h = 0xcbf29ce484222325ULL;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(out[0], buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            err(1, "Failed to read the output of %s", program);
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            h = (h ^ (uint8_t)buf[i]) * 0x100000001b3ULL;
+        }
+    }
+    close(out[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) err(1, "waitpid");
+    }
+    double seconds = elapsed_seconds(&start);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        errx(1, "%s failed (status %#x)", program, status);
+    }
+    *digest = h;
+    return seconds;
+}
+
+/* Split a command at spaces into argv (at most BENCH_MAX_ARGS words); the words point into copy
+*/
+static void split_command(char const *command, char *copy, char *argv[]) {
+    strcpy(copy, command);
+    int n = 0;
+    for (char *word = strtok(copy, " "); word && n < BENCH_MAX_ARGS; word = strtok(NULL, " ")) {
+        argv[n++] = word;
+    }
+    if (n == 0) {
+        errx(1, "Empty command");
+    }
+    argv[n] = NULL;
+}
+
+static void bench_size(long n_lines, char **commands, int n_commands, int err_fd);
+
+int main(int argc, char *argv[]) {
+    static char *default_commands[] = {
+        "./mtp-mutex --stats -n 1",
+        "./mtp --stats -n 1",
+        "./mtp --stats -n 16",
+        "./mtp --stats -n 256",
+        "./mtp --stats -n 256 -s newline*1,plus",
+        "./mtp --stats -n 4096 -b 1048576",
+        "./mtp --stats -j 4",
+        "./mtp --stats --fused",
+    };
+    char *sizes = strdup(argc > 1 ? argv[1] : "1000,30000,1000000");
+    char **commands = argc > 2 ? argv + 2 : default_commands;
+    int n_commands = argc > 2 ? argc - 2 : (int)(sizeof(default_commands) / sizeof(default_commands[0]));
+    if (!sizes) {
+        err(1, "Memory allocation failed");
+    }
+
+    FILE *run_stderr = tmpfile();
+    if (!run_stderr) {
+        err(1, "Failed to create the benchmark files");
+    }
+    char *size_save;
+    for (char *size_arg = strtok_r(sizes, ",", &size_save); size_arg; size_arg = strtok_r(NULL, ",", &size_save)) {
+        char *end;
+        long n_lines = strtol(size_arg, &end, 10);
+        if (*end != '\0' || n_lines < 0) {
+            errx(1, "Usage: %s [LINES[,LINES...] [COMMAND...]]", argv[0]);
+        }
+        bench_size(n_lines, commands, n_commands, fileno(run_stderr));
+    }
+    fclose(run_stderr);
+    free(sizes);
+    return 0;
+}
+
+/* One input size: every command on the same input
+*/
+static void bench_size(long n_lines, char **commands, int n_commands, int err_fd) {
+    srand(1);
+    FILE *input = tmpfile();
+    if (!input) {
+        err(1, "Failed to create the benchmark input");
+    }
+    size_t size = make_input(input, n_lines);
+    printf("\ninput: %ld lines, %zu bytes\n", n_lines, size);
+    fflush(stdout);
+
+    int reps = n_lines < BENCH_SMALL_LINES ? BENCH_SMALL_REPS : BENCH_REPS;
+    uint64_t expected = 0;
+    for (int c = 0; c < n_commands; c++) {
+        char *copy = malloc(strlen(commands[c]) + 1);
+        char *cmd_argv[BENCH_MAX_ARGS + 1];
+        if (!copy) {
+            err(1, "Memory allocation failed");
+        }
+        split_command(commands[c], copy, cmd_argv);
+
+        double best = 0;
+        char report[BENCH_MAX_STDERR];
+        size_t n_report = 0;
+        for (int rep = 0; rep < reps; rep++) {
+            uint64_t digest;
+            double seconds = run_once(cmd_argv, fileno(input), err_fd, &digest);
+            if (c == 0 && rep == 0) {
+                expected = digest;
+            } else if (digest != expected) {
+                errx(1, "%s: output differs from %s", commands[c], commands[0]);
+            }
+            if (rep == 0 || seconds < best) {
+                best = seconds;
+                ssize_t n = pread(err_fd, report, sizeof(report), 0);
+                n_report = n > 0 ? n : 0;
+            }
+        }
+        printf("%-36s %10.0f lines/s %8.1f MB/s\n", commands[c], n_lines / best, size / 1e6 / best);
+        fwrite(report, 1, n_report, stdout);
+        fflush(stdout);                                     /* Before the next fork() */
+        free(copy);
+    }
+    fclose(input);
+}
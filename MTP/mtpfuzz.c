@@ -0,0 +1,123 @@
+/* mtpfuzz: the SIMD kernels in transform.c against the scalar one. Each case replaces newlines, replaces
+   "++" both into a fresh buffer and compacted over its own input a few bytes further on (as the plus stage
+   does), and searches for the next '+' or newline from every offset; the first kernel whose answer differs
+   from scalar's fails the run.
+
+   "mtpfuzz [ITERATIONS] [SEED]" makes up its own text, heavy in '+' runs and line breaks. The makefile's
+   mtpfuzz-libfuzzer target compiles the same cases with -DMTP_LIBFUZZER, without main(), for libFuzzer.
+*/
+
+#include <stdio.h>      // fprintf() of the failing case
+#include <stdlib.h>     // malloc(), rand(), abort()
+#include <stdint.h>     // uint8_t input bytes
+#include <string.h>     // memcmp() against the scalar output
+#include <err.h>        // err() when memory runs out
+#include <time.h>       // time() seeds a run given no SEED
+
+#include "transform.h"
+
+/* A kernel disagreed with scalar: say which and on how long a text, and abort(). Under libFuzzer the abort()
+   is what saves the input for replay.
+*/
+static void fuzz_fail(char const *what, char const *kernel, size_t len) {
+    fprintf(stderr, "mtpfuzz: %s (kernel %s, %zu bytes)\n", what, kernel, len);
+    abort();
+}
+
+/* One fuzz case. The first byte sets how far below its input the in-place "++" replacement writes; the
+   rest is the text.
+*/
+int LLVMFuzzerTestOneInput(uint8_t const *data, size_t size) {
+    if (size == 0) return 0;
+    size_t shift = data[0] & 7;
+    char const *text = (char const *)data + 1;
+    size_t len = size - 1;
+
+    char *expected = malloc(len + 1);
+    char *actual = malloc(len + 1);
+    char *moved = malloc(shift + len + 1);
+    if (!expected || !actual || !moved) {
+        err(1, "Memory allocation failed");
+    }
+
+    mtp_use_kernel("scalar");
+    memcpy(expected, text, len);
+    mtp_replace_newlines(expected, len);
+    char *plus_expected = malloc(len + 1);
+    if (!plus_expected) {
+        err(1, "Memory allocation failed");
+    }
+    size_t n_plus = mtp_replace_plus(plus_expected, text, len);
+
+    for (char const *const *k = mtp_kernel_names; *k; k++) {
+        if (!mtp_use_kernel(*k)) continue;
+
+        memcpy(actual, text, len);
+        mtp_replace_newlines(actual, len);
+        if (memcmp(actual, expected, len)) {
+            fuzz_fail("newline replacement differs from scalar", *k, len);
+        }
+
+        if (mtp_replace_plus(actual, text, len) != n_plus || memcmp(actual, plus_expected, n_plus)) {
+            fuzz_fail("\"++\" replacement differs from scalar", *k, len);
+        }
+        memcpy(moved + shift, text, len);
+        if (mtp_replace_plus(moved, moved + shift, len) != n_plus || memcmp(moved, plus_expected, n_plus)) {
+            fuzz_fail("in-place \"++\" replacement differs from scalar", *k, len);
+        }
+
+        for (size_t off = 0; off <= len; off++) {
+            size_t found = mtp_find_special(text + off, len - off);
+            mtp_use_kernel("scalar");
+            size_t reference = mtp_find_special(text + off, len - off);
+            mtp_use_kernel(*k);
+            if (found != reference) {
+                fuzz_fail("special-character search differs from scalar", *k, len);
+            }
+        }
+    }
+    mtp_use_kernel(mtp_kernel_names[0]);
+
+    free(expected);
+    free(actual);
+    free(moved);
+    free(plus_expected);
+    return 0;
+}
+
+#ifndef MTP_LIBFUZZER
+/* Standalone driver: random lengths, mostly short (the kernels' edges are within the first few blocks)
+   with an occasional long one, drawn from a few characters so '+' runs of every length and newlines at
+   every offset come up often
+*/
+int main(int argc, char *argv[]) {
+    static char const charset[] = "++++++++\n\nab ^";
+    if (argc > 3) {
+        errx(1, "Usage: %s [ITERATIONS] [SEED]", argv[0]);
+    }
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    unsigned seed = argc > 2 ? strtoul(argv[2], NULL, 10) : (unsigned)time(0);
+    srand(seed);
+
+    enum { MAX_LEN = 1 << 14 };
+    uint8_t *buf = malloc(MAX_LEN + 1);
+    if (!buf) {
+        err(1, "Memory allocation failed");
+    }
+    for (unsigned long i = 0; i < iterations; i++) {
+        size_t len = rand() % 64 == 0 ? rand() % MAX_LEN : rand() % 200;
+        int plus_bias = rand() % 3;                         /* 0: charset as is, 1: mostly '+', 2: few '+' */
+        buf[0] = rand() & 0xFF;
+        for (size_t j = 1; j <= len; j++) {
+            char c = charset[rand() % (sizeof(charset) - 1)];
+            if (plus_bias == 1 && rand() % 4) c = '+';
+            if (plus_bias == 2 && c == '+' && rand() % 8) c = 'x';
+            buf[j] = c;
+        }
+        LLVMFuzzerTestOneInput(buf, len + 1);
+    }
+    printf("mtpfuzz: %lu cases passed (seed %u)\n", iterations, seed);
+    free(buf);
+    return 0;
+}
+#endif
@@ -0,0 +1,176 @@
+/* Latency check for the -t flush deadline: for each COMMAND and each count in LATENCY_COUNTS, writes that
+   many full 80-character lines to the command's standard input and then pauses, with the pipe still open,
+   and measures how long the first output takes to come out. However the lines were batched (full batches
+   closed by -n or -b, or one still filling), it must come out within MS ms (-t MS, passed on to every
+   command) plus LATENCY_SLACK_MS; a command that holds lines back until more input or end of input
+   fails the check.
+
+   Usage: mtplatency [-t MS] [COMMAND...]    (a COMMAND is a program and its arguments, separated by spaces)
+   By default it checks both queue builds, small batches, workers and --fused. Exits with 1 if any check
+   failed.
+*/
+
+#include <stdio.h>      // Standard input and output
+#include <stdlib.h>     // atoi()
+#include <string.h>     // strlen(), strtok(), memset()
+#include <err.h>        // Convenience functions for error reporting (non-standard)
+#include <errno.h>      // EINTR
+#include <stdbool.h>    // Boolean type and values
+#include <time.h>       // clock_gettime()
+#include <poll.h>       // poll()
+#include <signal.h>     // signal()
+#include <unistd.h>     // fork(), pipe(), dup2(), execv()
+#include <sys/wait.h>   // waitpid()
+
+#define LATENCY_MAX_ARGS 32
+#define LATENCY_SLACK_MS 200                                /* Allowed on top of -t, for scheduling */
+#define LATENCY_PAUSE_MS 3000                               /* How long the input pauses */
+
+// Lines before the pause: under, at and over the default 256-line batch. The output of 512 lines still
+// fits in a pipe, so the command never blocks writing it while nothing reads.
+static int const latency_counts[] = {1, 5, 255, 256, 257, 512};
+
+static double elapsed_ms(struct timespec const *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void write_all(int fd, char const *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            err(1, "Failed to write the input");
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+/* Split a command at spaces into argv (at most LATENCY_MAX_ARGS words) and append -t flush_ms; the words
+   point into copy
+*/
+static void split_command(char const *command, char *copy, char *argv[], char *flush_arg) {
+    strcpy(copy, command);
+    int n = 0;
+    for (char *word = strtok(copy, " "); word && n < LATENCY_MAX_ARGS; word = strtok(NULL, " ")) {
+        argv[n++] = word;
+    }
+    if (n == 0) {
+        errx(1, "Empty command");
+    }
+    argv[n++] = "-t";
+    argv[n++] = flush_arg;
+    argv[n] = NULL;
+}
+
+/* Run argv, feed it n_lines lines and pause, and return the milliseconds to its first output, or -1 if
+   there was none before the pause ended
+*/
+static double first_output_ms(char *const argv[], int n_lines) {
+    int in[2], out[2];
+    if (pipe(in) < 0 || pipe(out) < 0) {
+        err(1, "pipe");
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        err(1, "fork");
+    }
+    if (pid == 0) {
+        if (dup2(in[0], STDIN_FILENO) < 0 || dup2(out[1], STDOUT_FILENO) < 0) {
+            err(1, "Failed to set up %s", argv[0]);
+        }
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execv(argv[0], argv);
+        err(127, "Failed to run %s", argv[0]);
+    }
+    close(in[0]);
+    close(out[1]);
+
+    // Each line is one output record: 79 characters and the newline, which becomes a space
+    char line[80];
+    memset(line, 'a', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\n';
+    for (int i = 0; i < n_lines; i++) {
+        write_all(in[1], line, sizeof(line));
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double latency = -1;
+    struct pollfd pfd = {.fd = out[0], .events = POLLIN};
+    while (latency < 0 && elapsed_ms(&start) < LATENCY_PAUSE_MS) {
+        int ready = poll(&pfd, 1, LATENCY_PAUSE_MS - (int)elapsed_ms(&start));
+        if (ready < 0 && errno != EINTR) {
+            err(1, "poll");
+        }
+        if (ready > 0) {
+            latency = elapsed_ms(&start);
+        }
+    }
+
+    // End the input and drain the output, so the command finishes
+    write_all(in[1], "STOP\n", 5);
+    close(in[1]);
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(out[0], buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno != EINTR) {
+            err(1, "Failed to read the output of %s", argv[0]);
+        }
+    }
+    close(out[0]);
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) err(1, "waitpid");
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        errx(1, "%s failed (status %#x)", argv[0], status);
+    }
+    return latency;
+}
+
+int main(int argc, char *argv[]) {
+    static char const *defaults[] = {"./mtp", "./mtp-mutex", "./mtp -n 100", "./mtp -b 4096", "./mtp -j 4",
+                                     "./mtp -s newline,plus", "./mtp --fused"};
+    int flush_ms = 10, first = 1;
+    if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+        flush_ms = atoi(argv[2]);
+        first = 3;
+    }
+    if (flush_ms < 0 || flush_ms + LATENCY_SLACK_MS >= LATENCY_PAUSE_MS) {
+        errx(1, "Usage: %s [-t MS] [COMMAND...]    (MS under %d)", argv[0], LATENCY_PAUSE_MS - LATENCY_SLACK_MS);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char const **commands = first < argc ? (char const **)argv + first : defaults;
+    int n_commands = first < argc ? argc - first : (int)(sizeof(defaults) / sizeof(defaults[0]));
+    char flush_arg[16];
+    snprintf(flush_arg, sizeof(flush_arg), "%d", flush_ms);
+    int failures = 0;
+    for (int c = 0; c < n_commands; c++) {
+        char copy[strlen(commands[c]) + 1], *command_argv[LATENCY_MAX_ARGS + 3];
+        split_command(commands[c], copy, command_argv, flush_arg);
+        for (size_t i = 0; i < sizeof(latency_counts) / sizeof(latency_counts[0]); i++) {
+            double latency = first_output_ms(command_argv, latency_counts[i]);
+            bool ok = latency >= 0 && latency <= flush_ms + LATENCY_SLACK_MS;
+            failures += !ok;
+            if (latency >= 0) {
+                printf("%-28s -t %-5d %4d lines  first output %8.1f ms  %s\n", commands[c], flush_ms,
+                       latency_counts[i], latency, ok ? "ok" : "FAIL");
+            } else {
+                printf("%-28s -t %-5d %4d lines  no output in %d ms  FAIL\n", commands[c], flush_ms,
+                       latency_counts[i], LATENCY_PAUSE_MS);
+            }
+        }
+    }
+    if (failures > 0) {
+        printf("mtplatency: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("mtplatency: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,259 @@
+/* Newline, "++" and special-character scanning kernels for mtp. See transform.h.
+*/
+
+#include <stdint.h>     // Extra fixed-width data types
+#include <string.h>     // memmove(), memset(), strcmp()
+#include <stdbool.h>    // Boolean type and values
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // SSE2/AVX2 intrinsics
+#define MTP_X86 1
+#endif
+
+#include "transform.h"
+
+static void replace_newlines_scalar(char *text, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == '\n') {
+            text[i] = ' ';
+        }
+    }
+}
+
+/* Scalar "++" replacement from src[i] on, with j characters already written to dst
+*/
+static size_t replace_plus_tail(char *dst, char const *src, size_t i, size_t j, size_t len) {
+    while (i < len) {
+        if (src[i] == '+' && i + 1 < len && src[i + 1] == '+') {
+            dst[j++] = '^';
+            i += 2; // Skip over the second "+"
+        } else {
+            dst[j++] = src[i++];
+        }
+    }
+    return j;
+}
+
+static size_t replace_plus_scalar(char *dst, char const *src, size_t len) {
+    return replace_plus_tail(dst, src, 0, 0, len);
+}
+
+static size_t find_special_scalar(char const *text, size_t len) {
+    size_t i = 0;
+    while (i < len && text[i] != '+' && text[i] != '\n') {
+        i++;
+    }
+    return i;
+}
+
+/* Move the text between pairs down to dst, unless it is already there
+*/
+static inline void move_run(char *dst, char const *src, size_t n) {
+    if (dst != src) {
+        memmove(dst, src, n);
+    }
+}
+
+/* Pair off the run of '+' starting at src[k], writing "^" per pair and a lone '+' for an odd one out.
+ * Returns the run's length.
+ */
+static inline size_t replace_plus_run(char *dst, char const *src, size_t k, size_t *j, size_t len) {
+    size_t end = k;
+    while (end < len && src[end] == '+') {
+        end++;
+    }
+    size_t run = end - k;
+    memset(dst + *j, '^', run / 2);
+    *j += run / 2;
+    if (run & 1) {
+        dst[(*j)++] = '+';
+    }
+    return run;
+}
+
+#ifdef MTP_X86
+/* SSE2 kernels: 16 bytes per compare. The "++" kernel compares the block with itself shifted by one to
+   find positions where a pair starts, copies the pair-free stretch before the first one in bulk, and
+   pairs off that run of '+' from the left. The run really starts there: a '+' just before it would have
+   started a pair itself, in this block or (as the last byte) in the previous one.
+*/
+__attribute__((target("sse2")))
+static void replace_newlines_sse2(char *text, size_t len) {
+    __m128i const newline = _mm_set1_epi8('\n');
+    __m128i const space = _mm_set1_epi8(' ');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i const *)(text + i));
+        __m128i is_newline = _mm_cmpeq_epi8(v, newline);
+        if (_mm_movemask_epi8(is_newline)) {
+            v = _mm_or_si128(_mm_andnot_si128(is_newline, v), _mm_and_si128(is_newline, space));
+            _mm_storeu_si128((__m128i *)(text + i), v);
+        }
+    }
+    replace_newlines_scalar(text + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static size_t replace_plus_sse2(char *dst, char const *src, size_t len) {
+    __m128i const plus = _mm_set1_epi8('+');
+    size_t i = 0, j = 0;
+    while (i + 17 <= len) {                                 /* The shifted load reads src[i + 16] */
+        __m128i here = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i const *)(src + i)), plus);
+        __m128i next = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i const *)(src + i + 1)), plus);
+        unsigned pairs = _mm_movemask_epi8(_mm_and_si128(here, next));
+        size_t k = pairs ? i + __builtin_ctz(pairs) : i + 16;
+        move_run(dst + j, src + i, k - i);
+        j += k - i;
+        i = k;
+        if (pairs) {
+            i += replace_plus_run(dst, src, k, &j, len);
+        }
+    }
+    return replace_plus_tail(dst, src, i, j, len);
+}
+
+__attribute__((target("sse2")))
+static size_t find_special_sse2(char const *text, size_t len) {
+    __m128i const newline = _mm_set1_epi8('\n');
+    __m128i const plus = _mm_set1_epi8('+');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i const *)(text + i));
+        unsigned special = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, newline), _mm_cmpeq_epi8(v, plus)));
+        if (special) return i + __builtin_ctz(special);
+    }
+    return i + find_special_scalar(text + i, len - i);
+}
+
+/* AVX2 kernels: the SSE2 kernels 32 bytes at a time
+*/
+__attribute__((target("avx2")))
+static void replace_newlines_avx2(char *text, size_t len) {
+    __m256i const newline = _mm256_set1_epi8('\n');
+    __m256i const space = _mm256_set1_epi8(' ');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i const *)(text + i));
+        __m256i is_newline = _mm256_cmpeq_epi8(v, newline);
+        if (_mm256_movemask_epi8(is_newline)) {
+            _mm256_storeu_si256((__m256i *)(text + i), _mm256_blendv_epi8(v, space, is_newline));
+        }
+    }
+    replace_newlines_sse2(text + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t replace_plus_avx2(char *dst, char const *src, size_t len) {
+    __m256i const plus = _mm256_set1_epi8('+');
+    size_t i = 0, j = 0;
+    while (i + 33 <= len) {
+        __m256i here = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i const *)(src + i)), plus);
+        __m256i next = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i const *)(src + i + 1)), plus);
+        uint32_t pairs = _mm256_movemask_epi8(_mm256_and_si256(here, next));
+        size_t k = pairs ? i + __builtin_ctz(pairs) : i + 32;
+        move_run(dst + j, src + i, k - i);
+        j += k - i;
+        i = k;
+        if (pairs) {
+            i += replace_plus_run(dst, src, k, &j, len);
+        }
+    }
+    return replace_plus_tail(dst, src, i, j, len);
+}
+
+__attribute__((target("avx2")))
+static size_t find_special_avx2(char const *text, size_t len) {
+    __m256i const newline = _mm256_set1_epi8('\n');
+    __m256i const plus = _mm256_set1_epi8('+');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i const *)(text + i));
+        uint32_t special = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, newline),
+                                                                _mm256_cmpeq_epi8(v, plus)));
+        if (special) return i + __builtin_ctz(special);
+    }
+    return i + find_special_sse2(text + i, len - i);
+}
+#endif
+
+/* One entry per instruction set, holding all three transforms, so that the stages of a run all use the same
+   one. Fastest first; mtpbench and mtpfuzz go down the list with mtp_use_kernel().
+*/
+static struct mtp_kernel {
+    char const *name;
+    char const *cpu_feature;                                /* NULL = always available */
+    void (*replace_newlines)(char *text, size_t len);
+    size_t (*replace_plus)(char *dst, char const *src, size_t len);
+    size_t (*find_special)(char const *text, size_t len);
+} const kernels[] = {
+#ifdef MTP_X86
+    {"avx2",   "avx2", replace_newlines_avx2,   replace_plus_avx2,   find_special_avx2},
+    {"sse2",   "sse2", replace_newlines_sse2,   replace_plus_sse2,   find_special_sse2},
+#endif
+    {"scalar", NULL,   replace_newlines_scalar, replace_plus_scalar, find_special_scalar},
+};
+#define N_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+char const *const mtp_kernel_names[] = {
+#ifdef MTP_X86
+    "avx2",
+    "sse2",
+#endif
+    "scalar",
+    NULL
+};
+
+static struct mtp_kernel const *kernel = &kernels[N_KERNELS - 1];
+
+/* cpu_feature is the name __builtin_cpu_supports() knows it by; the builtin takes only a string literal,
+   hence the strcmp()s
+*/
+static bool kernel_supported(struct mtp_kernel const *k) {
+    if (!k->cpu_feature) return true;
+#ifdef MTP_X86
+    __builtin_cpu_init();
+    if (!strcmp(k->cpu_feature, "avx2")) return __builtin_cpu_supports("avx2");
+    if (!strcmp(k->cpu_feature, "sse2")) return __builtin_cpu_supports("sse2");
+#endif
+    return false;
+}
+
+bool mtp_use_kernel(char const *name) {
+    for (size_t i = 0; i < N_KERNELS; i++) {
+        if (!strcmp(kernels[i].name, name)) {
+            if (!kernel_supported(&kernels[i])) return false;
+            kernel = &kernels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+char const *mtp_kernel(void) {
+    return kernel->name;
+}
+
+/* Pick the kernel before main(). mtp never changes it afterwards, so its stage threads, all started later,
+   read kernel without a lock.
+*/
+__attribute__((constructor))
+static void mtp_transform_init(void) {
+    for (size_t i = 0; i < N_KERNELS; i++) {
+        if (kernel_supported(&kernels[i])) {
+            kernel = &kernels[i];
+            break;
+        }
+    }
+}
+
+void mtp_replace_newlines(char *text, size_t len) {
+    kernel->replace_newlines(text, len);
+}
+
+size_t mtp_replace_plus(char *dst, char const *src, size_t len) {
+    return kernel->replace_plus(dst, src, len);
+}
+
+size_t mtp_find_special(char const *text, size_t len) {
+    return kernel->find_special(text, len);
+}
@@ -0,0 +1,27 @@
+/* The text transforms behind mtp's stages. Each has a scalar, an SSE2 and an AVX2 kernel; the fastest one
+ * the CPU supports is picked when the program starts.
+ */
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Replace every newline in text[0, len) with a space, in place */
+extern void mtp_replace_newlines(char *text, size_t len);
+
+/* Replace each "++" in src[0, len) with "^", pairing from the left ("+++" becomes "^+"), and write the
+ * result to dst. dst may be src itself or lie before it, so a line can be compacted in place or moved
+ * down over text already consumed. Returns the length written.
+ */
+extern size_t mtp_replace_plus(char *dst, char const *src, size_t len);
+
+/* Offset of the first '+' or newline in text[0, len), or len if there is none */
+extern size_t mtp_find_special(char const *text, size_t len);
+
+/* Kernel selection, for benchmarks and tests */
+extern char const *const mtp_kernel_names[];                 /* Compiled-in kernels, fastest first, NULL-terminated */
+extern bool mtp_use_kernel(char const *name);                 /* False if unknown or not supported by this CPU */
+extern char const *mtp_kernel(void);                          /* Name of the kernel in use */
+
+#endif
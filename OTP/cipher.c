@@ -0,0 +1,221 @@
+/* Modulo 27 encryption and decryption kernels of libotp. See libotp.h.
+*/
+
+#include <stdint.h>     // Extra fixed-width data types
+#include <string.h>     // strcmp()
+#include <stdbool.h>    // Boolean type and values
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // SSE2/AVX2 intrinsics
+#define OTP_X86 1
+#endif
+
+#include "libotp.h"
+
+/* The scalar kernels: the servers' original loops, with each character checked against the alphabet
+*/
+static inline bool inAlphabet(char c) {
+    return c == ' ' || (c >= 'A' && c <= 'Z');
+}
+
+static bool encryptScalar(char *out, const char *text, const char *key, size_t len) {
+    bool valid = true;
+    for (size_t i = 0; i < len; i++) {
+        valid &= inAlphabet(text[i]) && inAlphabet(key[i]);
+        // Convert plaintext character p and key character k to numbers
+        int p = (text[i] == ' ') ? 26 : text[i] - 'A';
+        int k = (key[i] == ' ') ? 26 : key[i] - 'A';
+        // Combine them using modular addition
+        int c = (p + k) % 27;
+        out[i] = (c == 26) ? ' ' : 'A' + c;
+    }
+    return valid;
+}
+
+static bool decryptScalar(char *out, const char *text, const char *key, size_t len) {
+    bool valid = true;
+    for (size_t i = 0; i < len; i++) {
+        valid &= inAlphabet(text[i]) && inAlphabet(key[i]);
+        int c = (text[i] == ' ') ? 26 : text[i] - 'A';
+        int k = (key[i] == ' ') ? 26 : key[i] - 'A';
+        // Decrypt using modular subtraction
+        int p = (c - k + 27) % 27;
+        out[i] = (p == 26) ? ' ' : 'A' + p;
+    }
+    return valid;
+}
+
+#ifdef OTP_X86
+/* SSE2 kernels: 16 characters per step, without branches or division. Space becomes 26 by a compare and
+   a blend, a character is in the alphabet if it is space or at most 25 above 'A' (an unsigned min and a
+   compare), and the sum or difference is brought back into [0, 27) by subtracting or adding 27 where a
+   compare says it is out.
+*/
+__attribute__((target("sse2")))
+static inline __m128i toValuesSse2(__m128i v, __m128i *valid) {
+    __m128i space = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+    __m128i letter = _mm_sub_epi8(v, _mm_set1_epi8('A'));
+    __m128i isLetter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(25)), letter);
+    *valid = _mm_and_si128(*valid, _mm_or_si128(space, isLetter));
+    return _mm_or_si128(_mm_andnot_si128(space, letter), _mm_and_si128(space, _mm_set1_epi8(26)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i toCharsSse2(__m128i v) {
+    __m128i space = _mm_cmpeq_epi8(v, _mm_set1_epi8(26));
+    __m128i letter = _mm_add_epi8(v, _mm_set1_epi8('A'));
+    return _mm_or_si128(_mm_andnot_si128(space, letter), _mm_and_si128(space, _mm_set1_epi8(' ')));
+}
+
+__attribute__((target("sse2")))
+static inline bool cipherSse2(char *out, const char *text, const char *key, size_t len, bool decrypt) {
+    __m128i const modulus = _mm_set1_epi8(27);
+    __m128i valid = _mm_set1_epi8(-1);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i t = toValuesSse2(_mm_loadu_si128((__m128i const *)(text + i)), &valid);
+        __m128i k = toValuesSse2(_mm_loadu_si128((__m128i const *)(key + i)), &valid);
+        __m128i v;
+        if (decrypt) {
+            v = _mm_sub_epi8(t, k);                                         /* -26 .. 26 */
+            v = _mm_add_epi8(v, _mm_and_si128(_mm_cmpgt_epi8(_mm_setzero_si128(), v), modulus));
+        } else {
+            v = _mm_add_epi8(t, k);                                         /* 0 .. 52 */
+            v = _mm_sub_epi8(v, _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(26)), modulus));
+        }
+        _mm_storeu_si128((__m128i *)(out + i), toCharsSse2(v));
+    }
+    bool tail = decrypt ? decryptScalar(out + i, text + i, key + i, len - i)
+                        : encryptScalar(out + i, text + i, key + i, len - i);
+    return _mm_movemask_epi8(valid) == 0xFFFF && tail;
+}
+
+__attribute__((target("sse2")))
+static bool encryptSse2(char *out, const char *text, const char *key, size_t len) {
+    return cipherSse2(out, text, key, len, false);
+}
+
+__attribute__((target("sse2")))
+static bool decryptSse2(char *out, const char *text, const char *key, size_t len) {
+    return cipherSse2(out, text, key, len, true);
+}
+
+/* AVX2 kernels: the SSE2 kernels 32 characters at a time, blending with vpblendvb
+*/
+__attribute__((target("avx2")))
+static inline __m256i toValuesAvx2(__m256i v, __m256i *valid) {
+    __m256i space = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+    __m256i letter = _mm256_sub_epi8(v, _mm256_set1_epi8('A'));
+    __m256i isLetter = _mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(25)), letter);
+    *valid = _mm256_and_si256(*valid, _mm256_or_si256(space, isLetter));
+    return _mm256_blendv_epi8(letter, _mm256_set1_epi8(26), space);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i toCharsAvx2(__m256i v) {
+    __m256i space = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(26));
+    return _mm256_blendv_epi8(_mm256_add_epi8(v, _mm256_set1_epi8('A')), _mm256_set1_epi8(' '), space);
+}
+
+__attribute__((target("avx2")))
+static inline bool cipherAvx2(char *out, const char *text, const char *key, size_t len, bool decrypt) {
+    __m256i const modulus = _mm256_set1_epi8(27);
+    __m256i valid = _mm256_set1_epi8(-1);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i t = toValuesAvx2(_mm256_loadu_si256((__m256i const *)(text + i)), &valid);
+        __m256i k = toValuesAvx2(_mm256_loadu_si256((__m256i const *)(key + i)), &valid);
+        __m256i v;
+        if (decrypt) {
+            v = _mm256_sub_epi8(t, k);
+            v = _mm256_add_epi8(v, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_setzero_si256(), v), modulus));
+        } else {
+            v = _mm256_add_epi8(t, k);
+            v = _mm256_sub_epi8(v, _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(26)), modulus));
+        }
+        _mm256_storeu_si256((__m256i *)(out + i), toCharsAvx2(v));
+    }
+    bool tail = cipherSse2(out + i, text + i, key + i, len - i, decrypt);
+    return (uint32_t)_mm256_movemask_epi8(valid) == 0xFFFFFFFF && tail;
+}
+
+__attribute__((target("avx2")))
+static bool encryptAvx2(char *out, const char *text, const char *key, size_t len) {
+    return cipherAvx2(out, text, key, len, false);
+}
+
+__attribute__((target("avx2")))
+static bool decryptAvx2(char *out, const char *text, const char *key, size_t len) {
+    return cipherAvx2(out, text, key, len, true);
+}
+#endif
+
+/* Encryption and decryption come in pairs, so the servers can never encrypt with one instruction set and
+   decrypt with another. Fastest first; each pair needs everything the ones after it need, so whatever this
+   CPU runs is the tail of the table from kernels[usable] on.
+*/
+static struct otpKernel {
+    char const *name;
+    bool (*encrypt)(char *out, const char *text, const char *key, size_t len);
+    bool (*decrypt)(char *out, const char *text, const char *key, size_t len);
+} const kernels[] = {
+#ifdef OTP_X86
+    {"avx2",   encryptAvx2,   decryptAvx2},
+    {"sse2",   encryptSse2,   decryptSse2},
+#endif
+    {"scalar", encryptScalar, decryptScalar},
+};
+#define N_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+char const *const otpKernelNames[] = {
+#ifdef OTP_X86
+    "avx2",
+    "sse2",
+#endif
+    "scalar",
+    NULL
+};
+
+static size_t usable = N_KERNELS - 1;
+static struct otpKernel const *kernel = &kernels[N_KERNELS - 1];
+
+bool otpUseKernel(char const *name) {
+    for (size_t i = usable; i < N_KERNELS; i++) {
+        if (!strcmp(kernels[i].name, name)) {
+            kernel = &kernels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+char const *otpKernel(void) {
+    return kernel->name;
+}
+
+/* Before main(), or when a program loads libotp.so: find the pairs this CPU runs and start on the fastest.
+   Only 32-bit x86 can lack SSE2.
+*/
+__attribute__((constructor))
+static void otpCipherInit(void) {
+#ifdef OTP_X86
+    __builtin_cpu_init();
+    usable = __builtin_cpu_supports("avx2") ? 0 : __builtin_cpu_supports("sse2") ? 1 : 2;
+#endif
+    kernel = &kernels[usable];
+}
+
+bool otpEncrypt(char *out, const char *text, const char *key, size_t len) {
+    return kernel->encrypt(out, text, key, len);
+}
+
+bool otpDecrypt(char *out, const char *text, const char *key, size_t len) {
+    return kernel->decrypt(out, text, key, len);
+}
+
+bool otpInAlphabet(const char *text, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (!inAlphabet(text[i])) return false;
+    }
+    return true;
+}
@@ -0,0 +1,97 @@
+/* Microbenchmark for the OTP cipher kernels: encrypts and decrypts random text with a random key, in place,
+   with each kernel at sizes from a short message up to SIZE, and reports MB/s and cycles/byte. Each result
+   is checked against the scalar kernel first.
+
+   Usage: cipherbench [SIZE]    (default 1048576)
+*/
+
+#include <stdio.h>      // Standard input and output
+#include <stdlib.h>     // malloc(), free(), rand()
+#include <stdint.h>     // Extra fixed-width data types
+#include <string.h>     // memcmp(), memcpy()
+#include <err.h>        // Convenience functions for error reporting (non-standard)
+#include <time.h>       // clock_gettime()
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>  // __rdtsc()
+#define OTP_X86 1
+#endif
+
+#include "libotp.h"
+
+#define BENCH_BYTES (256 << 20)                             /* Repeat each size until this much has gone through */
+
+static char const alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+static double elapsedSeconds(struct timespec const *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Time stamp counter for cycles/byte. It ticks at the nominal clock rate, not the current core clock,
+   so it is comparable between runs on one machine rather than an exact core cycle count.
+*/
+static uint64_t readCycles(void) {
+#ifdef OTP_X86
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        errx(1, "Usage: %s [SIZE]", argv[0]);
+    }
+    size_t maxSize = argc > 1 ? strtoul(argv[1], NULL, 10) : 1 << 20;
+    if (maxSize < 1) {
+        errx(1, "SIZE must be positive");
+    }
+    char *text = malloc(maxSize), *key = malloc(maxSize), *work = malloc(maxSize), *expected = malloc(maxSize);
+    if (!text || !key || !work || !expected) {
+        err(1, "Memory allocation failed");
+    }
+    srand(1);
+    for (size_t i = 0; i < maxSize; i++) {
+        text[i] = alphabet[rand() % 27];
+        key[i] = alphabet[rand() % 27];
+    }
+
+    printf("%-8s %-8s %10s %10s %12s\n", "kernel", "op", "size", "MB/s", "cycles/byte");
+    for (size_t size = 64; ; size = size * 16 < maxSize ? size * 16 : maxSize) {
+        for (int decrypt = 0; decrypt < 2; decrypt++) {
+            bool (*cipher)(char *, const char *, const char *, size_t) = decrypt ? otpDecrypt : otpEncrypt;
+            otpUseKernel("scalar");
+            cipher(expected, text, key, size);
+            for (char const *const *k = otpKernelNames; *k; k++) {
+                if (!otpUseKernel(*k)) continue;
+                memcpy(work, text, size);
+                if (!cipher(work, work, key, size) || memcmp(work, expected, size)) {
+                    errx(1, "%s kernel: %s differs from scalar at %zu characters", *k,
+                         decrypt ? "decryption" : "encryption", size);
+                }
+
+                // In place, over and over: each pass's output is valid input for the next
+                long reps = BENCH_BYTES / size > 0 ? BENCH_BYTES / size : 1;
+                struct timespec start;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                uint64_t cycles = readCycles();
+                for (long r = 0; r < reps; r++) {
+                    cipher(work, work, key, size);
+                }
+                cycles = readCycles() - cycles;
+                double seconds = elapsedSeconds(&start);
+                printf("%-8s %-8s %10zu %10.0f %12.3f\n", *k, decrypt ? "decrypt" : "encrypt", size,
+                       size * (double)reps / 1e6 / seconds, (double)cycles / ((double)size * reps));
+            }
+        }
+        if (size == maxSize) break;
+    }
+    otpUseKernel(otpKernelNames[0]);
+    free(text);
+    free(key);
+    free(work);
+    free(expected);
+    return 0;
+}
@@ -0,0 +1,283 @@
+/* Frames, I/O helpers and the client side of libotp. See libotp.h; the cipher kernels are in cipher.c and
+   the serving models in otp_server.c.
+*/
+
+#include <stdio.h>              // Input/output operations
+#include <stdlib.h>             // General utilities like exit()
+#include <string.h>             // String operations like memset()
+#include <stdarg.h>             // otpError()'s arguments
+#include <errno.h>              // EINTR, EAGAIN, EPROTO, ETIMEDOUT
+#include <unistd.h>             // close()
+#include <poll.h>               // poll()
+#include <sys/types.h>          // Definitions of data types used in system calls
+#include <sys/socket.h>         // Socket programming
+#include <sys/uio.h>            // struct iovec
+#include <netinet/in.h>         // Internet domain address structures
+#include <arpa/inet.h>          // htonl(), ntohl()
+#include <netdb.h>              // gethostbyname()
+
+#include "libotp.h"
+
+#define HOSTNAME "localhost"    // Where the clients find the servers
+
+void otpPackHeader(unsigned char *header, enum otpFrameType type, uint32_t length) {
+    uint32_t bigEndian = htonl(length);
+    header[0] = OTP_VERSION;
+    header[1] = type;
+    header[2] = header[3] = 0;
+    memcpy(header + 4, &bigEndian, sizeof(bigEndian));
+}
+
+bool otpUnpackHeader(const unsigned char *header, enum otpFrameType *type, uint32_t *length) {
+    uint32_t bigEndian;
+    if (header[0] != OTP_VERSION) return false;
+    memcpy(&bigEndian, header + 4, sizeof(bigEndian));
+    *type = header[1];
+    *length = ntohl(bigEndian);
+    return true;
+}
+
+bool otpSendAll(int fd, const void *data, size_t size) {
+    for (size_t done = 0; done < size; ) {
+        ssize_t n = send(fd, (const char *)data + done, size - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+bool otpReceiveAll(int fd, void *data, size_t size) {
+    for (size_t done = 0; done < size; ) {
+        ssize_t n = recv(fd, (char *)data + done, size - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0) errno = ECONNRESET;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+bool otpSetupAddress(struct sockaddr_in *address, const char *hostname, int port) {
+    // Clear out the address struct
+    memset(address, '\0', sizeof(*address));
+    // The address should be network capable
+    address->sin_family = AF_INET;
+    // Store the port number
+    address->sin_port = htons(port);
+    if (!hostname) {
+        // Allow a client at any address to connect to this server
+        address->sin_addr.s_addr = INADDR_ANY;
+        return true;
+    }
+    // Copy the first IP address from the DNS entry for this host name
+    struct hostent *hostInfo = gethostbyname(hostname);
+    if (hostInfo == NULL) return false;
+    memcpy(&address->sin_addr.s_addr, hostInfo->h_addr_list[0], hostInfo->h_length);
+    return true;
+}
+
+void otpError(int status, const char *format, ...) {
+    int savedErrno = errno;
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, ": %s\n", strerror(savedErrno));
+    exit(status);
+}
+
+char *otpReadFile(const char *path, size_t *length) {
+    FILE *file = fopen(path, "r");
+    if (!file) return NULL;
+    size_t capacity = 4096, size = 0;
+    char *data = malloc(capacity);
+    while (data) {
+        size += fread(data + size, 1, capacity - size - 1, file);
+        if (size < capacity - 1) break;
+        char *grown = realloc(data, capacity * 2);
+        if (!grown) {
+            free(data);
+            data = NULL;
+            break;
+        }
+        data = grown;
+        capacity *= 2;
+    }
+    if (data && ferror(file)) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    if (!data) return NULL;
+    // Remove the newline character if present
+    if (size > 0 && data[size - 1] == '\n') size--;
+    data[size] = '\0';
+    *length = size;
+    return data;
+}
+
+bool otpHandshake(int fd, const struct otpService *client) {
+    char id[16];
+    size_t idLength = strlen(client->serverID);
+    if (!otpSendAll(fd, client->clientID, strlen(client->clientID)) || !otpReceiveAll(fd, id, idLength)) {
+        return false;
+    }
+    if (memcmp(id, client->serverID, idLength) != 0) {
+        errno = EPROTO;
+        return false;
+    }
+    return true;
+}
+
+/* The rest of the frame that starts the outgoing bytes: the header, then text and key straight from the
+   caller's buffers, skipping the done bytes already sent
+*/
+static int outgoing(struct iovec *iov, const unsigned char *header, const char *text, const char *key,
+                    size_t n, size_t done) {
+    struct iovec parts[3] = {{(void *)header, OTP_HEADER_SIZE}, {(void *)text, n}, {(void *)key, n}};
+    int count = 0;
+    for (int i = 0; i < 3; i++) {
+        if (done >= parts[i].iov_len) {
+            done -= parts[i].iov_len;
+            continue;
+        }
+        iov[count].iov_base = (char *)parts[i].iov_base + done;
+        iov[count++].iov_len = parts[i].iov_len - done;
+        done = 0;
+    }
+    return count;
+}
+
+bool otpExchange(int fd, const char *text, const char *key, size_t len, size_t chunk, char *reply,
+                 struct timespec *firstReply) {
+    if (chunk == 0 || chunk > OTP_MAX_CHUNK) chunk = OTP_MAX_CHUNK;
+    unsigned char outHeader[OTP_HEADER_SIZE], inHeader[OTP_HEADER_SIZE];
+    size_t sent = 0;                // Characters of text in frames sent in full
+    size_t frameDone = 0;           // Bytes of the outgoing frame sent so far
+    size_t received = 0;            // Characters of reply received
+    size_t headerDone = 0;          // Bytes of the incoming header received so far
+    size_t replyLeft = 0;           // Characters of the incoming frame still to come
+    bool ended = false, finished = false;
+
+    while (!ended || !finished) {
+        struct pollfd p = {.fd = fd, .events = (ended ? 0 : POLLOUT) | (finished ? 0 : POLLIN)};
+        int ready = poll(&p, 1, OTP_TIMEOUT_MS);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0) return false;
+        if (ready == 0) {
+            errno = ETIMEDOUT;
+            return false;
+        }
+
+        if (p.revents & POLLOUT) {
+            // An OTP_DATA frame for the next chunk, or the OTP_END frame once all of them are out
+            size_t n = len - sent < chunk ? len - sent : chunk;
+            if (frameDone == 0) otpPackHeader(outHeader, sent < len ? OTP_DATA : OTP_END, n);
+            struct iovec iov[3];
+            struct msghdr msg = {.msg_iov = iov};
+            msg.msg_iovlen = outgoing(iov, outHeader, text + sent, key + sent, n, frameDone);
+            ssize_t s = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (s < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+            if (s > 0) frameDone += s;
+            if (frameDone == OTP_HEADER_SIZE + 2 * n) {
+                ended = sent == len;
+                sent += n;
+                frameDone = 0;
+            }
+        }
+
+        // Nothing more is read after OTP_END, though POLLHUP and POLLERR come whether asked for or not
+        if (!finished && (p.revents & (POLLIN | POLLHUP | POLLERR))) {
+            ssize_t r = headerDone < OTP_HEADER_SIZE
+                      ? recv(fd, inHeader + headerDone, OTP_HEADER_SIZE - headerDone, MSG_DONTWAIT)
+                      : recv(fd, reply + received, replyLeft, MSG_DONTWAIT);
+            if (r == 0) errno = ECONNRESET;
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) return false;
+            if (r < 0) continue;
+            if (headerDone < OTP_HEADER_SIZE) {
+                headerDone += r;
+                if (headerDone < OTP_HEADER_SIZE) continue;
+                enum otpFrameType type;
+                uint32_t length;
+                errno = EPROTO;
+                if (!otpUnpackHeader(inHeader, &type, &length)) return false;
+                if (type == OTP_END) {
+                    // OTP_END has no payload, and comes only after the whole reply
+                    if (length != 0 || received != len) return false;
+                    finished = true;
+                } else if (type != OTP_REPLY || length > len - received) {
+                    return false;
+                }
+                replyLeft = length;
+                if (replyLeft == 0) headerDone = 0;
+            } else {
+                if (received == 0 && firstReply) clock_gettime(CLOCK_MONOTONIC, firstReply);
+                received += r;
+                replyLeft -= r;
+                if (replyLeft == 0) headerDone = 0;
+            }
+        }
+    }
+    return true;
+}
+
+/* The message named name in file path, or exit */
+static char *readMessage(const char *path, const char *name, size_t *length) {
+    char *data = otpReadFile(path, length);
+    if (!data) {
+        fprintf(stderr, "Could not read %s file %s\n", name, path);
+        exit(1);
+    }
+    return data;
+}
+
+int otpClientMain(const struct otpService *client, const char *textName, int argc, char *argv[]) {
+    if (argc != 4) {
+        fprintf(stderr, "USAGE: %s %s key port\n", argv[0], textName);
+        exit(1);
+    }
+
+    size_t textLength, keyLength;
+    char *text = readMessage(argv[1], textName, &textLength);
+    char *key = readMessage(argv[2], "key", &keyLength);
+    // Verify that the key is long enough for the text, and that both are in the alphabet
+    if (keyLength < textLength) {
+        fprintf(stderr, "Error: key '%s' is shorter than %s '%s'.\n", argv[2], textName, argv[1]);
+        exit(1);
+    }
+    if (!otpInAlphabet(text, textLength) || !otpInAlphabet(key, textLength)) {
+        fprintf(stderr, "%s error: input contains bad characters\n", argv[0]);
+        exit(1);
+    }
+
+    struct sockaddr_in serverAddress;
+    if (!otpSetupAddress(&serverAddress, HOSTNAME, atoi(argv[3]))) {
+        fprintf(stderr, "%s ERROR, no such host\n", client->name);
+        exit(2);
+    }
+    int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (socketFD < 0) otpError(2, "%s: ERROR opening socket", client->name);
+    // Time out the handshake too, should something other than the server be listening
+    struct timeval tv = {.tv_sec = OTP_TIMEOUT_MS / 1000};
+    setsockopt(socketFD, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(socketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0) {
+        otpError(2, "%s: ERROR connecting to port %s", client->name, argv[3]);
+    }
+    if (!otpHandshake(socketFD, client)) {
+        otpError(2, "%s: could not contact %s on port %s", client->name, client->serverID, argv[3]);
+    }
+
+    char *reply = malloc(textLength + 1);
+    if (!reply) otpError(2, "%s: Memory allocation failed", client->name);
+    if (!otpExchange(socketFD, text, key, textLength, 0, reply, NULL)) {
+        otpError(2, "%s: ERROR exchanging the message with the server", client->name);
+    }
+    reply[textLength] = '\0';
+    printf("%s\n", reply);
+    close(socketFD);
+    free(text);
+    free(key);
+    free(reply);
+    return 0;
+}
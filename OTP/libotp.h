@@ -0,0 +1,112 @@
+/* libotp: everything enc_server, dec_server, enc_client and dec_client share, so that the four of them
+ * speak one protocol by construction: the modulo 27 one-time pad, the frames it travels in, blocking I/O
+ * helpers, and the client side of an exchange. The serving models are in otp_server.h.
+ *
+ * The pad works over the alphabet of the 26 capital letters and space (A is 0, Z is 25 and space is 26).
+ * Each operation has a scalar, an SSE2 and an AVX2 kernel; the fastest one the CPU supports is picked
+ * when the program starts.
+ *
+ * Protocol, version OTP_VERSION:
+ * 1. The client sends its identifier (ENC_CLIENT or DEC_CLIENT), and the server answers with its own
+ *    (ENC_SERVER or DEC_SERVER) if it serves that client, or closes the connection.
+ * 2. The client sends the text and key as OTP_DATA frames, each carrying up to OTP_MAX_CHUNK characters of
+ *    text followed by as many of key, and then an OTP_END frame.
+ * 3. The server answers each OTP_DATA frame with an OTP_REPLY frame of the same length as soon as it is
+ *    in, and the OTP_END frame with one of its own once every reply is out. Then it closes.
+ * Every frame starts with an OTP_HEADER_SIZE-byte header:
+ *    byte 0     OTP_VERSION
+ *    byte 1     type: OTP_DATA, OTP_REPLY or OTP_END
+ *    bytes 2-3  zero
+ *    bytes 4-7  payload length in characters per field, big-endian (0 for OTP_END)
+ * A server holds one frame at a time, so messages can be any length; a client has to keep reading replies
+ * while it sends, or both sides end up waiting to send. otpExchange() does that.
+ */
+#ifndef LIBOTP_H
+#define LIBOTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <netinet/in.h>
+
+/* By convention, exposed library interfaces are prefixed with "otp" */
+
+#define OTP_VERSION 1
+#define OTP_HEADER_SIZE 8
+#define OTP_MAX_CHUNK 65536         /* Longest frame payload, per field */
+#define OTP_TIMEOUT_MS 5000         /* How long a client waits for the server to make progress */
+
+enum otpFrameType {
+    OTP_DATA = 'D',                 /* Client to server: text, then key */
+    OTP_REPLY = 'R',                /* Server to client: the text run through the cipher */
+    OTP_END = 'E'                   /* Either way: no more frames */
+};
+
+/* One side of the protocol: its name for messages, the identifiers exchanged in the handshake, and for a
+ * server its cipher (otpEncrypt or otpDecrypt)
+ */
+struct otpService {
+    const char *name;               /* "Encryption Server" */
+    const char *clientID;           /* Sent by the client first */
+    const char *serverID;           /* Sent back once the client is verified */
+    bool (*cipher)(char *out, const char *text, const char *key, size_t len);
+};
+
+/* Cipher. out[i] = text[i] + key[i] (mod 27) for i < len. out may be text or key itself, so a frame can be
+ * turned into its reply where it was received. Returns false if text or key has a character outside the
+ * alphabet in [0, len), which is checked in the same pass; out then holds garbage.
+ */
+extern bool otpEncrypt(char *out, const char *text, const char *key, size_t len);
+
+/* out[i] = text[i] - key[i] (mod 27) for i < len, otherwise as otpEncrypt() */
+extern bool otpDecrypt(char *out, const char *text, const char *key, size_t len);
+
+/* True if text[0, len) is all in the alphabet */
+extern bool otpInAlphabet(const char *text, size_t len);
+
+/* Kernel selection, for benchmarks and tests */
+extern char const *const otpKernelNames[];                   /* Compiled-in kernels, fastest first, NULL-terminated */
+extern bool otpUseKernel(char const *name);                   /* False if unknown or not supported by this CPU */
+extern char const *otpKernel(void);                           /* Name of the kernel in use */
+
+/* Frames. otpUnpackHeader() returns false for a header of another version; header[0] has the version. */
+extern void otpPackHeader(unsigned char *header, enum otpFrameType type, uint32_t length);
+extern bool otpUnpackHeader(const unsigned char *header, enum otpFrameType *type, uint32_t *length);
+
+/* Blocking I/O on a socket, retried on EINTR and never raising SIGPIPE. False if the connection failed or
+ * closed before all size bytes went through.
+ */
+extern bool otpSendAll(int fd, const void *data, size_t size);
+extern bool otpReceiveAll(int fd, void *data, size_t size);
+
+/* Set up an address for port on hostname, or on every local address if hostname is NULL. False if
+ * hostname does not resolve.
+ */
+extern bool otpSetupAddress(struct sockaddr_in *address, const char *hostname, int port);
+
+/* Print a printf-style message and the error in errno to stderr, and exit with status */
+extern void otpError(int status, const char *format, ...) __attribute__((format(printf, 2, 3), noreturn));
+
+/* The whole contents of a file, without a trailing newline, in memory from malloc() with a '\0' after
+ * them. NULL with errno set if it could not be read.
+ */
+extern char *otpReadFile(const char *path, size_t *length);
+
+/* Client side. otpHandshake() sends client->clientID and checks the answer is client->serverID.
+ * otpExchange() then sends len characters of text and key in frames of at most chunk characters (0 for
+ * OTP_MAX_CHUNK), and receives the reply into reply[0, len) at the same time; if firstReply is not NULL it
+ * gets the CLOCK_MONOTONIC time the first characters of the reply came in. Either returns false, with errno
+ * set, if the server failed, closed, broke the protocol or went OTP_TIMEOUT_MS without making progress.
+ */
+extern bool otpHandshake(int fd, const struct otpService *client);
+extern bool otpExchange(int fd, const char *text, const char *key, size_t len, size_t chunk, char *reply,
+                        struct timespec *firstReply);
+
+/* main() of enc_client and dec_client: usage "program TEXTFILE KEYFILE PORT", where textName names the
+ * first file in messages ("plaintext"). Prints the reply to stdout. Exits with 1 for bad input and 2 if
+ * the exchange with the server on localhost failed.
+ */
+extern int otpClientMain(const struct otpService *client, const char *textName, int argc, char *argv[]);
+
+#endif
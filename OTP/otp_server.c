@@ -0,0 +1,488 @@
+/* Serving models for the OTP servers. See otp_server.h; the protocol is in libotp.h.
+
+In the event-driven model each connection is an explicit state machine over the fields of the protocol:
+1. Receive CLIENT_ID, and send SERVER_ID back if it matches
+2. Receive a frame header; for OTP_END, send OTP_END back and close
+3. Receive the frame's text and key, run them through the cipher in place, and send the reply frame from
+   the same buffer. Then back to 2.
+A loop moves every connection along as far as its socket allows without blocking, and waits in
+epoll_wait() for the next socket that can go further. The other models run the same protocol in
+serveConnection(), blocking, one connection per process or thread at a time.
+*/
+
+#define _GNU_SOURCE             // accept4()
+#include <stdio.h>              // Input/output operations
+#include <stdlib.h>             // General utilities like exit()
+#include <string.h>             // String operations like memset()
+#include <stdbool.h>            // Boolean type and values
+#include <stdint.h>             // uint32_t
+#include <signal.h>             // kill()
+#include <unistd.h>             // POSIX operating system API
+#include <errno.h>              // EAGAIN, EINTR
+#include <sys/types.h>          // Definitions of data types used in system calls
+#include <sys/socket.h>         // Socket programming
+#include <sys/epoll.h>          // epoll_create1(), epoll_ctl(), epoll_wait()
+#include <sys/wait.h>           // wait()
+#include <sys/prctl.h>          // prctl()
+#include <sys/time.h>           // struct timeval
+#include <pthread.h>            // Pool worker threads
+#include <netinet/in.h>         // Internet domain address structures
+
+#include "libotp.h"
+#include "otp_server.h"
+
+#define MAX_EVENTS 64           // Sockets handled per epoll_wait()
+// A pool worker gives up on a connection that makes no progress for this long: less than a client waits,
+// so that one queued behind a stalled connection is still served
+#define STALL_TIMEOUT_MS (OTP_TIMEOUT_MS / 2)
+
+/* Where a connection is in the protocol: the field it is receiving or sending
+*/
+enum connectionState {
+    READ_ID, WRITE_ID, READ_HEADER, READ_TEXT, READ_KEY, WRITE_REPLY, WRITE_END
+};
+
+struct connection {
+    int fd;
+    enum connectionState state;
+    uint32_t events;            // What epoll waits for on fd
+    size_t done;                // Bytes of the current field sent or received so far
+    uint32_t length;            // Characters of text and of key in the current frame
+    char id[16];                // CLIENT_ID as received
+    unsigned char header[OTP_HEADER_SIZE];  // Frame header received, or the OTP_END one sent
+    char *frame;                // Header and text of the current frame, turned into the reply in place
+    char *key;
+    uint32_t capacity;          // Characters frame and key have room for
+};
+
+static int epollFD;             // The loop of this process
+
+/* The buffer and size of the field conn is on, and whether it is sent rather than received
+*/
+static char *field(const struct otpService *service, struct connection *conn, size_t *size, bool *sending) {
+    *sending = conn->state == WRITE_ID || conn->state == WRITE_REPLY || conn->state == WRITE_END;
+    switch (conn->state) {
+    case READ_ID:
+        *size = strlen(service->clientID);
+        return conn->id;
+    case WRITE_ID:
+        *size = strlen(service->serverID);
+        return (char *)service->serverID;
+    case READ_HEADER:
+    case WRITE_END:
+        *size = OTP_HEADER_SIZE;
+        return (char *)conn->header;
+    case READ_TEXT:
+        *size = conn->length;
+        return conn->frame + OTP_HEADER_SIZE;
+    case READ_KEY:
+        *size = conn->length;
+        return conn->key;
+    case WRITE_REPLY:
+        *size = OTP_HEADER_SIZE + conn->length;
+        return conn->frame;
+    }
+    return NULL;
+}
+
+/* Check a frame header; false, with the reason printed, if the server cannot take the frame
+*/
+static bool checkHeader(const struct otpService *service, const unsigned char *header,
+                        enum otpFrameType *type, uint32_t *length) {
+    if (!otpUnpackHeader(header, type, length)) {
+        printf("%s ERROR: Frame of unsupported protocol version %d.\n", service->name, header[0]);
+        return false;
+    }
+    if ((*type != OTP_DATA && *type != OTP_END) || *length > OTP_MAX_CHUNK) {
+        printf("%s ERROR: Invalid frame of type %d and length %u.\n", service->name, *type,
+               (unsigned)*length);
+        return false;
+    }
+    return true;
+}
+
+/* Act on a field conn has finished and move it on to the next. Returns false to close the connection,
+ * with the protocol complete or failed.
+*/
+static bool finishField(const struct otpService *service, struct connection *conn) {
+    enum otpFrameType type;
+    switch (conn->state) {
+    case READ_ID:
+        if (memcmp(conn->id, service->clientID, strlen(service->clientID)) != 0) {
+            printf("%s ERROR: Client verification failed.\n", service->name);
+            return false;
+        }
+        conn->state = WRITE_ID;
+        return true;
+    case WRITE_ID:
+    case WRITE_REPLY:
+        conn->state = READ_HEADER;
+        return true;
+    case READ_HEADER:
+        if (!checkHeader(service, conn->header, &type, &conn->length)) return false;
+        if (type == OTP_END) {
+            otpPackHeader(conn->header, OTP_END, 0);
+            conn->state = WRITE_END;
+            return true;
+        }
+        // Room for the largest frame so far, and no more
+        if (!conn->frame || conn->length > conn->capacity) {
+            free(conn->frame);
+            free(conn->key);
+            conn->frame = malloc(OTP_HEADER_SIZE + conn->length);
+            conn->key = malloc(conn->length + 1);
+            if (!conn->frame || !conn->key) otpError(1, "Memory allocation failed");
+            conn->capacity = conn->length;
+        }
+        conn->state = READ_TEXT;
+        return true;
+    case READ_TEXT:
+        conn->state = READ_KEY;
+        return true;
+    case READ_KEY: {
+        char *text = conn->frame + OTP_HEADER_SIZE;
+        if (!service->cipher(text, text, conn->key, conn->length)) {
+            printf("%s ERROR: Bad characters in the text or key.\n", service->name);
+            return false;
+        }
+        otpPackHeader((unsigned char *)conn->frame, OTP_REPLY, conn->length);
+        conn->state = WRITE_REPLY;
+        return true;
+    }
+    case WRITE_END:
+        return false;
+    }
+    return false;
+}
+
+/* Have epoll wait for events on conn's socket, if it is not already
+*/
+static void waitFor(struct connection *conn, uint32_t events) {
+    if (conn->events != events) {
+        struct epoll_event ev = {.events = events, .data.ptr = conn};
+        if (epoll_ctl(epollFD, EPOLL_CTL_MOD, conn->fd, &ev) < 0) otpError(1, "epoll_ctl");
+        conn->events = events;
+    }
+}
+
+/* Move conn along until its socket would block. Returns false once it is done with, one way or another.
+*/
+static bool advance(const struct otpService *service, struct connection *conn) {
+    while (1) {
+        size_t size = 0;
+        bool sending;
+        char *buffer = field(service, conn, &size, &sending);
+        while (conn->done < size) {
+            ssize_t n = sending ? send(conn->fd, buffer + conn->done, size - conn->done, MSG_NOSIGNAL)
+                             : recv(conn->fd, buffer + conn->done, size - conn->done, 0);
+            if (n > 0) {
+                conn->done += n;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                waitFor(conn, sending ? EPOLLOUT : EPOLLIN);
+                return true;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else {
+                printf("%s ERROR: Connection lost before the exchange was complete.\n", service->name);
+                return false;
+            }
+        }
+        conn->done = 0;
+        if (!finishField(service, conn)) return false;
+    }
+}
+
+static void closeConnection(struct connection *conn) {
+    close(conn->fd);
+    free(conn->frame);
+    free(conn->key);
+    free(conn);
+}
+
+/* Take every connection waiting on the listening socket, and start each one off
+*/
+static void acceptConnections(const struct otpService *service, int listenSocket) {
+    while (1) {
+        int fd = accept4(listenSocket, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        struct connection *conn = calloc(1, sizeof(*conn));
+        if (!conn) otpError(1, "Memory allocation failed");
+        conn->fd = fd;
+        conn->state = READ_ID;
+        conn->events = EPOLLIN;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+        if (epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &ev) < 0) otpError(1, "epoll_ctl");
+        // The client sends its identifier straight away, so it has likely arrived already
+        if (!advance(service, conn)) closeConnection(conn);
+    }
+}
+
+/* One event loop, on its own listening socket
+*/
+static void runLoop(const struct otpService *service, int listenSocket) {
+    epollFD = epoll_create1(0);
+    if (epollFD < 0) otpError(1, "epoll_create1");
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, listenSocket, &ev) < 0) otpError(1, "epoll_ctl");
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(epollFD, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            otpError(1, "epoll_wait");
+        }
+        for (int i = 0; i < n; i++) {
+            struct connection *conn = events[i].data.ptr;
+            if (!conn) {
+                acceptConnections(service, listenSocket);
+            } else if (!advance(service, conn)) {
+                closeConnection(conn);
+            }
+        }
+    }
+}
+
+void serveConnection(const struct otpService *service, int connectionSocket) {
+    // One frame at a time: the reply goes out of the buffer the text came into
+    char frame[OTP_HEADER_SIZE + OTP_MAX_CHUNK], key[OTP_MAX_CHUNK];
+    char id[16];
+    size_t idLength = strlen(service->clientID);
+    if (!otpReceiveAll(connectionSocket, id, idLength) || memcmp(id, service->clientID, idLength) != 0) {
+        printf("%s ERROR: Client verification failed.\n", service->name);
+    } else if (!otpSendAll(connectionSocket, service->serverID, strlen(service->serverID))) {
+        printf("%s ERROR: Failed to send server identifier.\n", service->name);
+    } else {
+        while (1) {
+            enum otpFrameType type;
+            uint32_t length;
+            if (!otpReceiveAll(connectionSocket, frame, OTP_HEADER_SIZE)) {
+                printf("%s ERROR: Failed to receive frame header.\n", service->name);
+                break;
+            }
+            if (!checkHeader(service, (unsigned char *)frame, &type, &length)) break;
+            if (type == OTP_END) {
+                otpPackHeader((unsigned char *)frame, OTP_END, 0);
+                otpSendAll(connectionSocket, frame, OTP_HEADER_SIZE);
+                break;
+            }
+            if (!otpReceiveAll(connectionSocket, frame + OTP_HEADER_SIZE, length)
+                || !otpReceiveAll(connectionSocket, key, length)) {
+                printf("%s ERROR: Failed to receive frame.\n", service->name);
+                break;
+            }
+            if (!service->cipher(frame + OTP_HEADER_SIZE, frame + OTP_HEADER_SIZE, key, length)) {
+                printf("%s ERROR: Bad characters in the text or key.\n", service->name);
+                break;
+            }
+            otpPackHeader((unsigned char *)frame, OTP_REPLY, length);
+            if (!otpSendAll(connectionSocket, frame, OTP_HEADER_SIZE + length)) {
+                printf("%s ERROR: Failed to send reply.\n", service->name);
+                break;
+            }
+        }
+    }
+    close(connectionSocket);
+}
+
+/* A listening socket on port: non-blocking for the event loops, shared with the other loops' through
+ * SO_REUSEPORT where there are several
+*/
+static int listenOn(int port, int backlog, bool nonBlocking, bool reusePort) {
+    int listenSocket = socket(AF_INET, SOCK_STREAM | (nonBlocking ? SOCK_NONBLOCK : 0), 0);
+    if (listenSocket < 0) otpError(1, "SERVER ERROR opening socket");
+    int on = 1;
+    if (reusePort && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        otpError(1, "SERVER ERROR setting SO_REUSEPORT");
+    }
+    struct sockaddr_in address;
+    otpSetupAddress(&address, NULL, port);
+    if (bind(listenSocket, (struct sockaddr *)&address, sizeof(address)) < 0) otpError(1, "SERVER ERROR on binding");
+    if (listen(listenSocket, backlog) < 0) otpError(1, "SERVER ERROR on listen");
+    return listenSocket;
+}
+
+/* What a worker process runs on its listening socket
+*/
+typedef void workerMain(const struct otpService *service, int listenSocket, int threads);
+
+static pid_t startWorker(const struct otpService *service, int *listenSockets, int nSockets, int i,
+                         workerMain *run, int threads) {
+    pid_t pid = fork();
+    if (pid < 0) otpError(1, "SERVER ERROR on fork");
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);           // Go down with the server
+        signal(SIGPIPE, SIG_IGN);                   // A client gone mid-reply costs its connection only
+        for (int j = 0; j < nSockets; j++) {
+            if (j != i % nSockets) close(listenSockets[j]);
+        }
+        run(service, listenSockets[i % nSockets], threads);
+        exit(1);
+    }
+    return pid;
+}
+
+/* Run workers worker processes, worker i on listenSockets[i % nSockets], and start a new one in place of
+ * any that dies, so a crash costs only the connections it had in hand. Does not return.
+*/
+static void supervise(const struct otpService *service, int *listenSockets, int nSockets, int workers,
+                      workerMain *run, int threads) {
+    pid_t pids[workers];
+    for (int i = 0; i < workers; i++) {
+        pids[i] = startWorker(service, listenSockets, nSockets, i, run, threads);
+    }
+    // The listening sockets stay open here, so connections wait in the backlog while a worker restarts
+    while (1) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            otpError(1, "wait");
+        }
+        for (int i = 0; i < workers; i++) {
+            if (pids[i] != pid) continue;
+            if (WIFSIGNALED(status)) {
+                fprintf(stderr, "%s: worker %d (PID %d) killed by signal %d, restarting it\n", service->name, i,
+                        pid, WTERMSIG(status));
+            } else {
+                fprintf(stderr, "%s: worker %d (PID %d) exited with status %d, restarting it\n", service->name,
+                        i, pid, WEXITSTATUS(status));
+            }
+            pids[i] = startWorker(service, listenSockets, nSockets, i, run, threads);
+        }
+    }
+}
+
+static void runLoopWorker(const struct otpService *service, int listenSocket, int threads) {
+    (void)threads;
+    runLoop(service, listenSocket);
+}
+
+void serveEvents(const struct otpService *service, int port, int backlog, int loops) {
+    // Bind every socket before starting any loop, so a port in use fails once and up front
+    int listenSockets[loops];
+    for (int i = 0; i < loops; i++) {
+        listenSockets[i] = listenOn(port, backlog, true, loops > 1);
+    }
+    printf("%s: %d event loop%s listening on port %d\n", service->name, loops, loops > 1 ? "s" : "", port);
+    fflush(stdout);
+    supervise(service, listenSockets, loops, loops, runLoopWorker, 1);
+}
+
+/* The pool workers of this process: all of its threads block in accept() on the one listening socket and
+ * each handles the connections it gets itself, one after another
+*/
+static const struct otpService *poolService;
+static int poolSocket;
+
+static void *acceptLoop(void *args) {
+    (void)args;
+    while (1) {
+        int connectionSocket = accept(poolSocket, NULL, NULL);
+        if (connectionSocket < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) perror("accept");
+            continue;
+        }
+        // The worker is all this connection's until it ends, so a client that goes quiet must not keep it
+        struct timeval timeout = {.tv_sec = STALL_TIMEOUT_MS / 1000, .tv_usec = STALL_TIMEOUT_MS % 1000 * 1000};
+        setsockopt(connectionSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(connectionSocket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serveConnection(poolService, connectionSocket);
+    }
+    return NULL;
+}
+
+static void runPoolWorker(const struct otpService *service, int listenSocket, int threads) {
+    poolService = service;
+    poolSocket = listenSocket;
+    for (int t = 1; t < threads; t++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, acceptLoop, NULL) != 0) {
+            fprintf(stderr, "%s: failed to start a worker thread\n", service->name);
+            exit(1);
+        }
+    }
+    acceptLoop(NULL);
+}
+
+void servePool(const struct otpService *service, int port, int backlog, int processes, int threads) {
+    int listenSocket = listenOn(port, backlog, false, false);
+    printf("%s: %d worker process%s of %d thread%s listening on port %d\n", service->name, processes,
+           processes > 1 ? "es" : "", threads, threads > 1 ? "s" : "", port);
+    fflush(stdout);
+    supervise(service, &listenSocket, 1, processes, runPoolWorker, threads);
+}
+
+/* Reap the children of connections that are done
+*/
+static void cleanUpZombieProcesses(void) {
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        printf("Cleaned up zombie process PID: %d\n", pid);
+    }
+}
+
+void serveFork(const struct otpService *service, int port, int backlog) {
+    int listenSocket = listenOn(port, backlog, false, false);
+    printf("%s: forking a process per connection on port %d\n", service->name, port);
+    fflush(stdout);
+
+    // Accept a connection, blocking if one is not available until one connects
+    while (1) {
+        cleanUpZombieProcesses();
+        int connectionSocket = accept(listenSocket, NULL, NULL);
+        if (connectionSocket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            otpError(1, "SERVER ERROR on accept");
+        }
+        pid_t pid = fork();
+        if (pid < 0) otpError(1, "SERVER ERROR on fork");
+        if (pid == 0) {
+            close(listenSocket);
+            serveConnection(service, connectionSocket);
+            exit(0);
+        }
+        close(connectionSocket);
+    }
+}
+
+/* The usage message, and exit */
+static void usage(const struct otpService *service, const char *program) {
+    fprintf(stderr, "%s usage: %s port [-m fork|events|prefork|threads] [-l LOOPS] [-w WORKERS] "
+            "[-b BACKLOG]\n", service->name, program);
+    exit(1);
+}
+
+/* Serving models:
+-m fork (default): a process fork()ed per connection, with up to -b (by default five) connections queued
+-m events: -l event loops, one process each
+-m prefork: -w worker processes blocking in accept()
+-m threads: one process with -w worker threads blocking in accept()
+*/
+void otpServerMain(const struct otpService *service, int argc, char *argv[]) {
+    if (argc < 2) usage(service, argv[0]);
+    const char *mode = "fork";
+    int port = atoi(argv[1]), loops = 1, workers = 4, backlog = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) mode = argv[++i];
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) loops = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) backlog = atoi(argv[++i]);
+        else usage(service, argv[0]);
+    }
+    if (loops < 1 || workers < 1 || backlog < 0) usage(service, argv[0]);
+    if (strcmp(mode, "fork") == 0) {
+        serveFork(service, port, backlog ? backlog : 5);
+    } else if (strcmp(mode, "events") == 0) {
+        serveEvents(service, port, backlog ? backlog : SOMAXCONN, loops);
+    } else if (strcmp(mode, "prefork") == 0) {
+        servePool(service, port, backlog ? backlog : SOMAXCONN, workers, 1);
+    } else if (strcmp(mode, "threads") == 0) {
+        servePool(service, port, backlog ? backlog : SOMAXCONN, 1, workers);
+    }
+    usage(service, argv[0]);
+}
@@ -0,0 +1,42 @@
+/* Serving models for enc_server and dec_server. The servers differ only in their names, handshake
+ * identifiers and cipher, so they describe themselves with an otpService (libotp.h) and the models here
+ * run the protocol in libotp.h for both.
+ */
+#ifndef OTP_SERVER_H
+#define OTP_SERVER_H
+
+#include "libotp.h"
+
+/* main() of enc_server and dec_server: "program port [-m fork|events|prefork|threads] [-l LOOPS]
+ * [-w WORKERS] [-b BACKLOG]" picks one of the models below. Does not return.
+ */
+extern void otpServerMain(const struct otpService *service, int argc, char *argv[]);
+
+/* One whole connection, from the handshake on, blocking until the client ends it or fails; then closes
+ * the socket
+ */
+extern void serveConnection(const struct otpService *service, int connectionSocket);
+
+/* Serve connections on port with a new process fork()ed for each, the servers' original model. Does not
+ * return.
+ */
+extern void serveFork(const struct otpService *service, int port, int backlog);
+
+/* The models below run in worker processes under a supervisor, which starts a new worker in place of any
+ * that dies. backlog is passed to listen().
+ */
+
+/* Serve connections on port with loops event loops, each a process of its own multiplexing its
+ * connections with epoll. With more than one loop each has its own listening socket bound with
+ * SO_REUSEPORT, so the kernel spreads new connections between them. Does not return.
+ */
+extern void serveEvents(const struct otpService *service, int port, int backlog, int loops);
+
+/* Serve connections on port with a pool of processes, each with threads threads, all blocking in
+ * accept() on one listening socket and handling each connection they get with serveConnection(). The
+ * workers start once, up front, so no request waits for a fork(). A connection that makes no progress
+ * for half of OTP_TIMEOUT_MS is dropped, so idle clients cannot hold every worker. Does not return.
+ */
+extern void servePool(const struct otpService *service, int port, int backlog, int processes, int threads);
+
+#endif
@@ -0,0 +1,245 @@
+/* Connection benchmark for the OTP servers: starts each COMMAND as a server on a port of its own, opens
+   CONNECTIONS connections to it from CONCURRENCY client threads, each running the whole exchange for a
+   random SIZE-character text and key, and reports connections/sec and the latency percentiles of one
+   exchange (connect to close). Every reply is checked against the cipher, so the serving models are
+   tested against each other at the same time.
+
+   The clients are libotp's own (otpHandshake() and otpExchange()), so they speak exactly what enc_client
+   and dec_client speak. -k CHUNK sets the characters per frame (by default and at most OTP_MAX_CHUNK);
+   the time to the first byte of the reply shows what smaller frames gain.
+
+   Usage: otpbench [-n CONNECTIONS] [-c CONCURRENCY] [-s SIZE] [-k CHUNK] [COMMAND...]
+   A COMMAND is a server and its options, separated by spaces; the port goes in as its first argument.
+   The identifiers and cipher follow the server's name (enc_... or dec_...). By default it compares
+   enc_server's fork model with one event loop and with four.
+*/
+
+#include <stdio.h>      // Standard input and output
+#include <stdlib.h>     // malloc(), free(), rand(), qsort()
+#include <string.h>     // strlen(), strtok(), memcmp()
+#include <stdbool.h>    // Boolean type and values
+#include <err.h>        // Convenience functions for error reporting (non-standard)
+#include <time.h>       // clock_gettime(), nanosleep()
+#include <unistd.h>     // fork(), execv(), close()
+#include <signal.h>     // kill()
+#include <fcntl.h>      // open()
+#include <pthread.h>    // Client threads
+#include <sys/wait.h>   // waitpid()
+#include <sys/socket.h> // Socket programming
+#include <netinet/in.h> // Internet domain address structures
+#include <arpa/inet.h>  // htonl()
+
+#include "libotp.h"
+
+#define BENCH_MAX_ARGS 32
+#define BENCH_STARTUP_MS 5000                               /* How long a server gets to start listening */
+
+static char const alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+/* One benchmark run: what the clients send and expect, and the latency of each connection
+*/
+struct run {
+    int port;
+    struct otpService client;
+    char *text, *key;
+    char *reply;                                            /* The expected reply */
+    int size;
+    int chunk;
+    int connections;
+    int next;                                               /* Next connection to make */
+    int errors;
+    double *latency;
+    double *firstByte;                                      /* Time to the first byte of the reply */
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int value(char c) {
+    return c == ' ' ? 26 : c - 'A';
+}
+
+static int connectTo(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        err(1, "socket");
+    }
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(port),
+                                  .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* One whole exchange, as the server expects it; false if anything about it went wrong
+*/
+static bool exchange(struct run *r, char *reply, double start, double *firstByte) {
+    int fd = connectTo(r->port);
+    if (fd < 0) return false;
+    struct timespec first = {0};
+    bool ok = otpHandshake(fd, &r->client)
+           && otpExchange(fd, r->text, r->key, r->size, r->chunk, reply, &first)
+           && memcmp(reply, r->reply, r->size) == 0;
+    if (first.tv_sec || first.tv_nsec) *firstByte = first.tv_sec + first.tv_nsec / 1e9 - start;
+    // Wait for the server to close first, so the closed connections pile up on its side, not ours
+    char rest[16];
+    while (ok && recv(fd, rest, sizeof(rest), 0) > 0) {
+    }
+    close(fd);
+    return ok;
+}
+
+static void *client(void *args) {
+    struct run *r = args;
+    char *reply = malloc(r->size + 1);
+    if (!reply) {
+        err(1, "Memory allocation failed");
+    }
+    int i;
+    while ((i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED)) < r->connections) {
+        double start = now();
+        r->firstByte[i] = 0;
+        if (!exchange(r, reply, start, &r->firstByte[i])) {
+            __atomic_fetch_add(&r->errors, 1, __ATOMIC_RELAXED);
+        }
+        r->latency[i] = now() - start;
+    }
+    free(reply);
+    return NULL;
+}
+
+static int compareDoubles(void const *a, void const *b) {
+    double x = *(double const *)a, y = *(double const *)b;
+    return (x > y) - (x < y);
+}
+
+/* Start the server in command on port, with its output discarded, and wait until it accepts connections
+*/
+static pid_t startServer(char const *command, int port) {
+    char *copy = strdup(command), *argv[BENCH_MAX_ARGS + 2], portArg[16];
+    int argc = 0;
+    snprintf(portArg, sizeof(portArg), "%d", port);
+    for (char *arg = strtok(copy, " "); arg && argc < BENCH_MAX_ARGS; arg = strtok(NULL, " ")) {
+        argv[argc++] = arg;
+        if (argc == 1) argv[argc++] = portArg;
+    }
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        err(1, "fork");
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execv(argv[0], argv);
+        err(127, "%s", argv[0]);
+    }
+    free(copy);
+
+    for (int waited = 0; waited < BENCH_STARTUP_MS; waited += 10) {
+        int fd = connectTo(port);
+        if (fd >= 0) {
+            close(fd);
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            errx(1, "%s: exited before listening on port %d", command, port);
+        }
+        nanosleep(&(struct timespec){.tv_nsec = 10000000}, NULL);
+    }
+    kill(pid, SIGTERM);
+    errx(1, "%s: not listening on port %d", command, port);
+}
+
+static void bench(char const *command, int port, int connections, int concurrency, int size, int chunk) {
+    struct run r = {.port = port, .size = size, .chunk = chunk, .connections = connections};
+    char program[256];
+    snprintf(program, sizeof(program), "%s", command);
+    char const *name = strrchr(strtok(program, " "), '/');
+    bool decrypt = strncmp(name ? name + 1 : program, "dec", 3) == 0;
+    r.client = (struct otpService){"otpbench", decrypt ? "DEC_CLIENT" : "ENC_CLIENT",
+                                   decrypt ? "DEC_SERVER" : "ENC_SERVER", NULL};
+
+    // The same message for every connection, and the reply it should get
+    r.text = malloc(size + 1);
+    r.key = malloc(size + 1);
+    r.reply = malloc(size + 1);
+    r.latency = malloc(connections * sizeof(double));
+    r.firstByte = malloc(connections * sizeof(double));
+    if (!r.text || !r.key || !r.reply || !r.latency || !r.firstByte) {
+        err(1, "Memory allocation failed");
+    }
+    for (int i = 0; i < size; i++) {
+        r.text[i] = alphabet[rand() % 27];
+        r.key[i] = alphabet[rand() % 27];
+        int t = value(r.text[i]), k = value(r.key[i]);
+        r.reply[i] = alphabet[decrypt ? (t - k + 27) % 27 : (t + k) % 27];
+    }
+    pid_t server = startServer(command, port);
+    pthread_t threads[concurrency];
+    double start = now();
+    for (int t = 0; t < concurrency; t++) {
+        if (pthread_create(&threads[t], NULL, client, &r) != 0) {
+            errx(1, "Failed to start a client thread");
+        }
+    }
+    for (int t = 0; t < concurrency; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    double seconds = now() - start;
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+
+    qsort(r.latency, connections, sizeof(double), compareDoubles);
+    qsort(r.firstByte, connections, sizeof(double), compareDoubles);
+    printf("%-32s conn/s=%8.0f p50=%7.3fms p99=%7.3fms max=%7.3fms first_byte_p50=%7.3fms errors=%d\n",
+           command, connections / seconds, r.latency[connections / 2] * 1e3,
+           r.latency[connections * 99 / 100] * 1e3, r.latency[connections - 1] * 1e3,
+           r.firstByte[connections / 2] * 1e3, r.errors);
+    free(r.text);
+    free(r.key);
+    free(r.reply);
+    free(r.latency);
+    free(r.firstByte);
+}
+
+int main(int argc, char *argv[]) {
+    static char const *defaults[] = {"./enc_server -m fork", "./enc_server -m events",
+                                     "./enc_server -m events -l 4"};
+    int connections = 5000, concurrency = 8, size = 1000, chunk = 0, opt;
+    while ((opt = getopt(argc, argv, "n:c:s:k:")) != -1) {
+        switch (opt) {
+        case 'n': connections = atoi(optarg); break;
+        case 'c': concurrency = atoi(optarg); break;
+        case 's': size = atoi(optarg); break;
+        case 'k': chunk = atoi(optarg); break;
+        default:
+            errx(1, "Usage: %s [-n CONNECTIONS] [-c CONCURRENCY] [-s SIZE] [-k CHUNK] [COMMAND...]", argv[0]);
+        }
+    }
+    if (connections < 1 || concurrency < 1 || size < 0 || chunk < 0) {
+        errx(1, "CONNECTIONS and CONCURRENCY must be positive, and SIZE and CHUNK not negative");
+    }
+    srand(1);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("otpbench: %d connections, %d at a time, %d-character messages", connections, concurrency, size);
+    printf(chunk ? " in frames of %d\n" : "\n", chunk);
+    int port = 20000 + getpid() % 20000;
+    if (optind < argc) {
+        for (int i = optind; i < argc; i++) {
+            bench(argv[i], port++, connections, concurrency, size, chunk);
+        }
+    } else {
+        for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++) {
+            bench(defaults[i], port++, connections, concurrency, size, chunk);
+        }
+    }
+    return 0;
+}
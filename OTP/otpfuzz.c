@@ -0,0 +1,118 @@
+/* otpfuzz: cross-checks the cipher kernels in cipher.c. Each case splits its bytes into a text and a key
+   of equal length and takes the scalar otpEncrypt() and otpDecrypt() as the reference: every SIMD kernel
+   has to produce the same characters, whether writing to a separate buffer or over the text, and reach the
+   same verdict on characters outside the 27-letter alphabet. A ciphertext also has to decrypt back to its
+   text.
+
+   Run as "otpfuzz [ITERATIONS] [SEED]" it generates messages, most of them valid, some with a stray
+   character just outside the alphabet. Compiled with -DOTP_LIBFUZZER (make otpfuzz-libfuzzer) main() is
+   left out and libFuzzer calls LLVMFuzzerTestOneInput() instead.
+*/
+
+#include <stdio.h>      // fprintf() of the failing kernel
+#include <stdlib.h>     // malloc(), rand(), abort()
+#include <stdint.h>     // uint8_t input bytes
+#include <string.h>     // memcmp() against the scalar result
+#include <err.h>        // err() when memory runs out
+#include <time.h>       // time() seeds a run given no SEED
+
+#include "libotp.h"
+
+/* Name the kernel and the check it failed, then abort(): a core for the standalone run, a saved crash
+   input for libFuzzer
+*/
+static void fuzzFail(char const *what, char const *kernel, size_t len) {
+    fprintf(stderr, "otpfuzz: %s (kernel %s, %zu characters)\n", what, kernel, len);
+    abort();
+}
+
+/* One fuzz case: the first half of the data is the text, the second half the key
+*/
+int LLVMFuzzerTestOneInput(uint8_t const *data, size_t size) {
+    size_t len = size / 2;
+    char const *text = (char const *)data, *key = (char const *)data + len;
+    char *expected[2], *actual = malloc(len + 1), *roundTrip = malloc(len + 1);
+    bool expectedValid[2];
+    expected[0] = malloc(len + 1);
+    expected[1] = malloc(len + 1);
+    if (!expected[0] || !expected[1] || !actual || !roundTrip) {
+        err(1, "Memory allocation failed");
+    }
+
+    otpUseKernel("scalar");
+    expectedValid[0] = otpEncrypt(expected[0], text, key, len);
+    expectedValid[1] = otpDecrypt(expected[1], text, key, len);
+    if (expectedValid[0] != expectedValid[1]) {
+        fuzzFail("encryption and decryption disagree on the alphabet", "scalar", len);
+    }
+
+    for (char const *const *k = otpKernelNames; *k; k++) {
+        if (!otpUseKernel(*k)) continue;
+        for (int decrypt = 0; decrypt < 2; decrypt++) {
+            bool (*cipher)(char *, const char *, const char *, size_t) = decrypt ? otpDecrypt : otpEncrypt;
+            if (cipher(actual, text, key, len) != expectedValid[decrypt]) {
+                fuzzFail("alphabet check differs from scalar", *k, len);
+            }
+            // Only valid input has a defined result
+            if (expectedValid[decrypt] && memcmp(actual, expected[decrypt], len)) {
+                fuzzFail(decrypt ? "decryption differs from scalar" : "encryption differs from scalar", *k, len);
+            }
+            memcpy(actual, text, len);
+            cipher(actual, actual, key, len);
+            if (expectedValid[decrypt] && memcmp(actual, expected[decrypt], len)) {
+                fuzzFail("in-place result differs from scalar", *k, len);
+            }
+        }
+        if (expectedValid[0]) {
+            otpDecrypt(roundTrip, expected[0], key, len);
+            if (memcmp(roundTrip, text, len)) {
+                fuzzFail("decrypting the ciphertext does not give the text back", *k, len);
+            }
+        }
+    }
+    otpUseKernel(otpKernelNames[0]);
+
+    free(expected[0]);
+    free(expected[1]);
+    free(actual);
+    free(roundTrip);
+    return 0;
+}
+
+#ifndef OTP_LIBFUZZER
+/* Standalone driver: random lengths, mostly short (the kernels' edges are within the first few blocks)
+   with an occasional long one. Most inputs are all in the alphabet; the rest have a few characters just
+   outside it ('@', '[', and others) at random places.
+*/
+int main(int argc, char *argv[]) {
+    static char const alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+    static char const outside[] = "@[`\x1f!\n\x80\xff";
+    if (argc > 3) {
+        errx(1, "Usage: %s [ITERATIONS] [SEED]", argv[0]);
+    }
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    unsigned seed = argc > 2 ? strtoul(argv[2], NULL, 10) : (unsigned)time(0);
+    srand(seed);
+
+    enum { MAX_LEN = 1 << 14 };
+    uint8_t *buf = malloc(2 * MAX_LEN);
+    if (!buf) {
+        err(1, "Memory allocation failed");
+    }
+    for (unsigned long i = 0; i < iterations; i++) {
+        size_t len = rand() % 64 == 0 ? rand() % MAX_LEN : rand() % 200;
+        for (size_t j = 0; j < 2 * len; j++) {
+            buf[j] = alphabet[rand() % (sizeof(alphabet) - 1)];
+        }
+        if (len > 0 && rand() % 4 == 0) {
+            for (int bad = rand() % 3; bad >= 0; bad--) {
+                buf[rand() % (2 * len)] = outside[rand() % (sizeof(outside) - 1)];
+            }
+        }
+        LLVMFuzzerTestOneInput(buf, 2 * len);
+    }
+    printf("otpfuzz: %lu cases passed (seed %u)\n", iterations, seed);
+    free(buf);
+    return 0;
+}
+#endif